@@ -0,0 +1,457 @@
+#include <iostream>
+#include <cmath>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <tbb/parallel_for.h>
+
+#include "BRDF"
+
+typedef unsigned char ubyte;
+
+inline void convertVec2ToUintsetRGB(ubyte* ptr, const Vec2f& val)
+{
+    unsigned int A = uint(val[0]*65535 + 0.5); // + 0.5 I guess to avoid 0
+    unsigned int B = uint(val[1]*65535 + 0.5); //
+
+    ubyte v1 = (ubyte)(A >> 8 & 0xFF);
+    ubyte v0 = (ubyte)A & 0xFF;
+
+    ubyte v3 = (ubyte)(B >> 8 & 0xFF);
+    ubyte v2 = (ubyte)B & 0xFF;
+
+    ptr[0] = v0;
+    ptr[1] = v1;
+
+    ptr[2] = v2;
+    ptr[3] = v3;
+
+
+#if 0   // for debug
+        // to experiment output
+        // simluate unpacking
+
+    double a = (ptr[0] + ptr[1]*(65280.0/255.0))/65535.0;
+    double b = (ptr[2] + ptr[3]*(65280.0/255.0))/65535.0;
+
+    double aDiff = fabs( a - val[0] );
+    double bDiff = fabs( b - val[1] );
+
+    if ( aDiff > 1e-4 )
+        std::cerr << "something wrong in the lut encoding, error A " << aDiff << std::endl;
+
+    if ( bDiff > 1e-4 )
+        std::cerr << "something wrong in the lut encoding, error B " << bDiff << std::endl;
+#endif
+
+
+}
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+
+// the row integration has an avx2 variant selected at runtime
+#define BRDF_HAS_AVX2_PATH
+#define BRDF_FORCE_INLINE inline __attribute__((always_inline))
+
+static bool cpuHasAVX2()
+{
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2;
+}
+
+#else
+#define BRDF_FORCE_INLINE inline
+#endif
+
+// http://blog.selfshadow.com/publications/s2013-shading-course/karis/s2013_pbs_epic_notes_v2.pdf
+// page 7
+// integrates a row of the LUT, NoV are the lanes and the samples the outer
+// loop so each texel sums its samples in the same order than one texel at
+// a time. The float / double steps are the ones of the scalar version:
+// G_Schlick with the Schlick G1 computed in double, and Fc = (1 - VoH)^5
+BRDF_FORCE_INLINE void integrateBRDFRowImpl( float roughnessLinear, const float* NoV, float* sinV, float* G1V, uint size, const float* cacheHx, const float* cacheHz, uint numSamples, double* A, double* B )
+{
+    float roughness = roughnessLinear * roughnessLinear;
+    float m = roughness;
+    float k = m * 0.5;
+
+    for ( uint x = 0; x < size; x++ ) {
+        sinV[x] = sqrt( 1.0 - NoV[x] * NoV[x] );
+        // One generic factor of the geometry function divided by ndw
+        G1V[x] = 1.0 / ( NoV[x]*(1.0-k) + k );
+        A[x] = 0.0;
+        B[x] = 0.0;
+    }
+
+    for ( uint i = 0; i < numSamples; i++ ) {
+
+        float Hx = cacheHx[i];
+        float Hz = cacheHz[i];
+        float NoH = saturate( Hz );
+
+        for ( uint x = 0; x < size; x++ ) {
+
+            float VoHRaw = sinV[x] * Hx + NoV[x] * Hz;
+            float NoL = saturate( Hz * ( VoHRaw * 2.0f ) - NoV[x] );
+            float VoH = saturate( VoHRaw );
+
+            float G1L = 1.0 / ( NoL*(1.0-k) + k );
+            float G = NoV[x] * NoL * G1L * G1V[x];
+            float G_Vis = G * VoH / (NoH * NoV[x]);
+
+            double c = 1.0 - VoH;
+            double c2 = c * c;
+            float Fc = c2 * c2 * c;
+
+            A[x] += NoL > 0.0f ? (1.0 - Fc) * G_Vis : 0.0;
+            B[x] += NoL > 0.0f ? Fc * G_Vis : 0.0;
+        }
+    }
+
+    for ( uint x = 0; x < size; x++ ) {
+        A[x] /= numSamples;
+        B[x] /= numSamples;
+    }
+}
+
+static void integrateBRDFRowDefault( float roughnessLinear, const float* NoV, float* sinV, float* G1V, uint size, const float* cacheHx, const float* cacheHz, uint numSamples, double* A, double* B )
+{
+    integrateBRDFRowImpl( roughnessLinear, NoV, sinV, G1V, size, cacheHx, cacheHz, numSamples, A, B );
+}
+
+#if defined(BRDF_HAS_AVX2_PATH)
+__attribute__((target("avx2")))
+static void integrateBRDFRowAVX2( float roughnessLinear, const float* NoV, float* sinV, float* G1V, uint size, const float* cacheHx, const float* cacheHz, uint numSamples, double* A, double* B )
+{
+    integrateBRDFRowImpl( roughnessLinear, NoV, sinV, G1V, size, cacheHx, cacheHz, numSamples, A, B );
+}
+#endif
+
+static void integrateBRDFRow( float roughnessLinear, const float* NoV, float* sinV, float* G1V, uint size, const float* cacheHx, const float* cacheHz, uint numSamples, double* A, double* B )
+{
+#if defined(BRDF_HAS_AVX2_PATH)
+    if ( cpuHasAVX2() ) {
+        integrateBRDFRowAVX2( roughnessLinear, NoV, sinV, G1V, size, cacheHx, cacheHz, numSamples, A, B );
+        return;
+    }
+#endif
+    integrateBRDFRowDefault( roughnessLinear, NoV, sinV, G1V, size, cacheHx, cacheHz, numSamples, A, B );
+}
+
+// Charlie sheen with the Ashikhmin visibility, the samples are uniform on
+// the hemisphere so they are shared by all the rows, D only depends on the
+// sample and the roughness so it is computed out of the NoV lanes
+BRDF_FORCE_INLINE void integrateCharlieRowImpl( float roughnessLinear, const float* NoV, const float* sinV, uint size, const float* uniformHx, const float* uniformHz, uint numSamples, double* C )
+{
+    float alpha = roughnessLinear * roughnessLinear;
+    float invAlpha = 1.0f / alpha;
+
+    for ( uint x = 0; x < size; x++ )
+        C[x] = 0.0;
+
+    for ( uint i = 0; i < numSamples; i++ ) {
+
+        float Hx = uniformHx[i];
+        float Hz = uniformHz[i];
+        float NoH = saturate( Hz );
+        float sin2h = std::max( 1.0f - NoH * NoH, 0.0078125f ); // avoid 0 at NoH = 1 for small roughness
+        float D = ( 2.0f + invAlpha ) * pow( sin2h, invAlpha * 0.5f ) / ( 2.0f * float(PI) );
+
+        for ( uint x = 0; x < size; x++ ) {
+
+            float VoHRaw = sinV[x] * Hx + NoV[x] * Hz;
+            float NoL = saturate( Hz * ( VoHRaw * 2.0f ) - NoV[x] );
+            float VoH = saturate( VoHRaw );
+
+            float V = 1.0f / ( 4.0f * ( NoL + NoV[x] - NoL * NoV[x] ) );
+
+            // VoH comes from the jacobian of the reflection, 1 / ( 4 VoH )
+            C[x] += NoL > 0.0f ? V * D * NoL * VoH : 0.0f;
+        }
+    }
+
+    // uniform pdf is 1 / 2pi and 4 comes from the jacobian
+    for ( uint x = 0; x < size; x++ )
+        C[x] *= 4.0 * 2.0 * PI / numSamples;
+}
+
+static void integrateCharlieRowDefault( float roughnessLinear, const float* NoV, const float* sinV, uint size, const float* uniformHx, const float* uniformHz, uint numSamples, double* C )
+{
+    integrateCharlieRowImpl( roughnessLinear, NoV, sinV, size, uniformHx, uniformHz, numSamples, C );
+}
+
+#if defined(BRDF_HAS_AVX2_PATH)
+__attribute__((target("avx2")))
+static void integrateCharlieRowAVX2( float roughnessLinear, const float* NoV, const float* sinV, uint size, const float* uniformHx, const float* uniformHz, uint numSamples, double* C )
+{
+    integrateCharlieRowImpl( roughnessLinear, NoV, sinV, size, uniformHx, uniformHz, numSamples, C );
+}
+#endif
+
+static void integrateCharlieRow( float roughnessLinear, const float* NoV, const float* sinV, uint size, const float* uniformHx, const float* uniformHz, uint numSamples, double* C )
+{
+#if defined(BRDF_HAS_AVX2_PATH)
+    if ( cpuHasAVX2() ) {
+        integrateCharlieRowAVX2( roughnessLinear, NoV, sinV, size, uniformHx, uniformHz, numSamples, C );
+        return;
+    }
+#endif
+    integrateCharlieRowDefault( roughnessLinear, NoV, sinV, size, uniformHx, uniformHz, numSamples, C );
+}
+
+// V is in the xz plane and the tangent frame of N = (0,0,1) maps a local
+// sample h to ( h.y, -h.x, h.z ), so only the x and z components of H in
+// world space contribute to V.H and N.L. They are cached in two arrays and
+// a sample is shared by all the NoV values of a row.
+struct Worker {
+    uint _size;
+    uint _numSamples;
+    Vec2f* _lut;
+    Vec2f* _lutMultiscatter;
+    float* _lutCharlie;
+    const float* _cacheHx;
+    const float* _cacheHz;
+    const float* _uniformHx;
+    const float* _uniformHz;
+
+    // null tables are not computed
+    Worker(uint numSamples, uint size, Vec2f* lut, Vec2f* lutMultiscatter, float* lutCharlie, const float* cacheHx, const float* cacheHz, const float* uniformHx, const float* uniformHz):
+        _size(size), _numSamples(numSamples), _lut(lut), _lutMultiscatter(lutMultiscatter), _lutCharlie(lutCharlie), _cacheHx(cacheHx), _cacheHz(cacheHz), _uniformHx(uniformHx), _uniformHz(uniformHz)
+    {
+    }
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+
+        float step = 1.0/float(_size);
+
+        std::vector<float> sinV( _size ), NoV( _size ), G1V( _size );
+        std::vector<double> A( _size ), B( _size );
+
+        for ( uint y = r.begin(); y != r.end(); ++y ) {
+
+            float roughnessLinear = step * ( y + 0.5 );
+
+            for ( uint x = 0; x < _size; x++ )
+                NoV[x] = step * (x + 0.5);
+
+            if ( _lut || _lutMultiscatter ) {
+
+                integrateBRDFRow( roughnessLinear, &NoV[0], &sinV[0], &G1V[0], _size, &_cacheHx[ y*_numSamples ], &_cacheHz[ y*_numSamples ], _numSamples, &A[0], &B[0] );
+
+                for ( uint x = 0; x < _size; x++ ) {
+                    if ( _lut )
+                        _lut[ x + y*_size ] = Vec2f( clampTo(A[x],0.0,1.0) , clampTo(B[x],0.0,1.0) );
+                    if ( _lutMultiscatter )
+                        _lutMultiscatter[ x + y*_size ] = Vec2f( clampTo(B[x],0.0,1.0) , clampTo(A[x] + B[x],0.0,1.0) );
+                }
+            }
+
+            if ( _lutCharlie ) {
+
+                // sinV is filled by integrateBRDFRow, the ggx tables may not be computed
+                for ( uint x = 0; x < _size; x++ )
+                    sinV[x] = sqrt( 1.0 - NoV[x] * NoV[x] );
+
+                integrateCharlieRow( roughnessLinear, &NoV[0], &sinV[0], _size, _uniformHx, _uniformHz, _numSamples, &A[0] );
+
+                for ( uint x = 0; x < _size; x++ )
+                    _lutCharlie[ x + y*_size ] = clampTo(A[x],0.0,1.0);
+            }
+        }
+    }
+
+};
+
+
+struct WorkerPrepareCache {
+
+    uint _size;
+    uint _numSamples;
+    float* _cacheHx;
+    float* _cacheHz;
+
+    WorkerPrepareCache(uint numSamples, uint size, float* cacheHx, float* cacheHz): _size( size), _numSamples(numSamples), _cacheHx(cacheHx), _cacheHz(cacheHz) {}
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+
+        float step = 1.0/float(_size);
+
+        for ( uint y = r.begin(); y != r.end(); ++y ) {
+
+            float roughnessLinear = step * ( y + 0.5 );
+            uint cacheLineIndex = y;
+
+            for ( uint i = 0; i < _numSamples; i++ ) {
+                Vec3f H = importanceSampleGGX(i, _numSamples, roughnessLinear );
+                _cacheHx[ cacheLineIndex*_numSamples + i] = H[1];
+                _cacheHz[ cacheLineIndex*_numSamples + i] = H[2];
+            }
+        }
+    }
+
+};
+
+RougnessNoVLUT::RougnessNoVLUT( int size, uint samples )
+{
+    _size = size;
+    _lut = new Vec2f[size*size];
+    _lutMultiscatter = 0;
+    _lutCharlie = 0;
+    _cacheHx = 0;
+    _cacheHz = 0;
+    _maxValue = 0.0;
+    _nbSamples = samples;
+}
+
+RougnessNoVLUT::~RougnessNoVLUT()
+{
+    delete [] _lut;
+    delete [] _lutMultiscatter;
+    delete [] _lutCharlie;
+    delete [] _cacheHx;
+    delete [] _cacheHz;
+}
+
+void RougnessNoVLUT::prepareCacheGGX( uint numSamples, uint size )
+{
+    delete [] _cacheHx;
+    delete [] _cacheHz;
+    _cacheHx = new float[numSamples * size];
+    _cacheHz = new float[numSamples * size];
+    parallel_for(tbb::blocked_range<uint>(0, _size), WorkerPrepareCache(numSamples, size, _cacheHx, _cacheHz) );
+}
+
+void RougnessNoVLUT::computeTables( uint tables )
+{
+    uint numSamples = pow(2, uint(floor(log2(_nbSamples) )));
+
+    if ( tables & ( GGX | MULTISCATTER ) )
+        prepareCacheGGX(numSamples, _size);
+
+    if ( ( tables & MULTISCATTER ) && !_lutMultiscatter )
+        _lutMultiscatter = new Vec2f[_size*_size];
+
+    // uniform hemisphere samples from the same hammersley sequence
+    std::vector<float> uniformHx, uniformHz;
+    if ( tables & CHARLIE ) {
+        if ( !_lutCharlie )
+            _lutCharlie = new float[_size*_size];
+        uniformHx.resize( numSamples );
+        uniformHz.resize( numSamples );
+        for ( uint i = 0; i < numSamples; i++ ) {
+            Vec2f Xi = hammersley( i, numSamples );
+            float phi = 2.0 * PI * Xi[0];
+            float cosTheta = 1.0 - Xi[1];
+            float sinTheta = sqrt( 1.0 - cosTheta * cosTheta );
+            uniformHx[i] = sinTheta * cos( phi );
+            uniformHz[i] = cosTheta;
+        }
+    }
+
+    parallel_for(tbb::blocked_range<uint>(0, _size), Worker(numSamples, _size,
+                                                           ( tables & GGX ) ? _lut : 0,
+                                                           ( tables & MULTISCATTER ) ? _lutMultiscatter : 0,
+                                                           ( tables & CHARLIE ) ? _lutCharlie : 0,
+                                                           _cacheHx, _cacheHz,
+                                                           uniformHx.empty() ? 0 : &uniformHx[0],
+                                                           uniformHz.empty() ? 0 : &uniformHz[0] ) );
+}
+
+// from http://blog.selfshadow.com/publications/s2013-shading-course/karis/s2013_pbs_epic_notes_v2.pdf
+void RougnessNoVLUT::processRoughnessNoVLut( const std::string& filename )
+{
+    computeTables( GGX );
+
+    writeImage(filename.c_str(), _size, _size, _lut );
+}
+
+// round to nearest even, the tables are in [0 1] but the other values are
+// converted too
+static unsigned short floatToHalf( float value )
+{
+    union { float f; unsigned int u; } bits;
+    bits.f = value;
+
+    unsigned int sign = ( bits.u >> 16 ) & 0x8000;
+    unsigned int abs = bits.u & 0x7fffffff;
+
+    if ( abs >= 0x7f800000 ) // inf or nan
+        return sign | 0x7c00 | ( abs > 0x7f800000 ? 0x200 : 0 );
+
+    if ( abs < 0x38800000 ) // half subnormal, multiples of 2^-24
+        return sign | (unsigned short)lrintf( fabsf( value ) * 16777216.0f );
+
+    unsigned int half = ( abs - 0x38000000 ) >> 13;
+    unsigned int rest = abs & 0x1fff;
+    if ( rest > 0x1000 || ( rest == 0x1000 && ( half & 1 ) ) )
+        half++;
+    if ( half >= 0x7c00 ) // overflow
+        half = 0x7c00;
+    return sign | half;
+}
+
+// rgba8 is the rg16 packing of writeImage, the charlie table is the first
+// channel and 0. float formats write the channels of the table, 1 for
+// charlie and 2 for the others
+bool RougnessNoVLUT::writeTable( const std::string& filename, Table table, Format format ) const
+{
+    const Vec2f* lut2 = table == GGX ? _lut : table == MULTISCATTER ? _lutMultiscatter : 0;
+    if ( ( table == CHARLIE && !_lutCharlie ) || ( table != CHARLIE && !lut2 ) ) {
+        std::cout << "error table not computed for " << filename << std::endl;
+        return false;
+    }
+
+    uint count = _size * _size;
+    uint channels = table == CHARLIE ? 1 : 2;
+    std::vector<float> values( count * channels );
+    for ( uint i = 0; i < count; i++ ) {
+        if ( table == CHARLIE ) {
+            values[i] = _lutCharlie[i];
+        } else {
+            values[i*2] = lut2[i][0];
+            values[i*2+1] = lut2[i][1];
+        }
+    }
+
+    std::vector<ubyte> data;
+    if ( format == RGBA8 ) {
+        data.resize( count * 4 );
+        for ( uint i = 0; i < count; i++ )
+            convertVec2ToUintsetRGB( &data[i*4], Vec2f( values[i*channels], channels == 2 ? values[i*2+1] : 0.0f ) );
+    } else if ( format == FLOAT16 ) {
+        data.resize( values.size() * 2 );
+        for ( uint i = 0; i < values.size(); i++ ) {
+            unsigned short half = floatToHalf( values[i] );
+            memcpy( &data[i*2], &half, 2 );
+        }
+    } else {
+        data.resize( values.size() * 4 );
+        memcpy( &data[0], &values[0], data.size() );
+    }
+
+    FILE* file = fopen( filename.c_str(), "wb" );
+    if ( !file ) {
+        std::cout << "error can't write file " << filename << std::endl;
+        return false;
+    }
+    bool ok = fwrite( &data[0], data.size(), 1, file ) == 1;
+    ok = fclose( file ) == 0 && ok;
+    return ok;
+}
+
+int RougnessNoVLUT::writeImage(const char* filename, int width, int height, Vec2f *buffer)
+{
+    ubyte* data = new ubyte[width*height*4];
+    for ( int i = 0; i < width*height; i++ ) {
+        convertVec2ToUintsetRGB( data + i*4, buffer[i] );
+    }
+
+    FILE* file = fopen(filename,"wb");
+    fwrite(data, width*height*4, 1 , file );
+    fclose(file);
+    delete [] data;
+
+    return 0;
+}
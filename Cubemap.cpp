@@ -1,8 +1,15 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
 #include <cmath>
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <mutex>
 
 #include "Math"
 #include "Cubemap"
@@ -10,6 +17,26 @@
 #include <tbb/parallel_for.h>
 //#include <tbb/task_scheduler_init.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+
+// some loops have an avx2 variant selected at runtime
+#define CUBEMAP_HAS_AVX2_PATH
+#define CUBEMAP_FORCE_INLINE inline __attribute__((always_inline))
+
+static bool cpuHasAVX2()
+{
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2;
+}
+
+#else
+#define CUBEMAP_FORCE_INLINE inline
+#endif
+
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/filter.h>
 #include <OpenImageIO/imagebuf.h>
@@ -19,6 +46,9 @@ OIIO_NAMESPACE_USING
 
 void texelCoordToVectCubeMap(int face, float ui, float vi, uint size, float* dirResult, int fixup = 0);
 
+// number of directions processed at once by the prefilter / background
+static const uint SampleBatchSize = 32;
+
 Cubemap::Cubemap()
 {
     _levels.resize(1);
@@ -33,18 +63,65 @@ Cubemap::~Cubemap()
 Cubemap::MipLevel::MipLevel()
 {
     _size = 0;
+    _samplePerPixel = 0;
+    _data = 0;
+    _mappedLength = 0;
+    _shared = false;
     for ( int i = 0; i < 6; i++ ) {
         _images[i] = 0;
     }
 }
 
+Cubemap::MipLevel::MipLevel( const MipLevel& level )
+{
+    _size = 0;
+    _samplePerPixel = 0;
+    _data = 0;
+    _mappedLength = 0;
+    _shared = false;
+    for ( int i = 0; i < 6; i++ ) {
+        _images[i] = 0;
+    }
+    *this = level;
+}
 
 Cubemap::MipLevel::~MipLevel()
 {
-    for ( int i = 0; i < 6; i++ ) {
-        if ( _images[i] )
-            delete [] _images[i];
+    release();
+}
+
+void Cubemap::MipLevel::release()
+{
+    // a shared level does not own its faces
+    if ( !_shared ) {
+        if ( _mappedLength )
+            munmap( _data, _mappedLength );
+        else if ( _data )
+            delete [] _data;
     }
+    _data = 0;
+    _mappedLength = 0;
+    _shared = false;
+}
+
+Cubemap::MipLevel& Cubemap::MipLevel::operator=( const MipLevel& level )
+{
+    if ( this == &level )
+        return *this;
+
+    if ( !level._data ) {
+        release();
+        _size = level._size;
+        _samplePerPixel = level._samplePerPixel;
+        for ( int i = 0; i < 6; i++ ) {
+            _images[i] = 0;
+        }
+        return *this;
+    }
+
+    init( level._size, level._samplePerPixel );
+    std::copy( level._data, level._data + 6*_size*_size*_samplePerPixel, _data );
+    return *this;
 }
 
 
@@ -52,10 +129,47 @@ void Cubemap::MipLevel::init( uint size, uint sample )
 {
     _size = size;
     _samplePerPixel = sample;
+    release();
+
+    uint faceSize = size*size*sample;
+    _data = new float[6*faceSize];
+    for ( int i = 0; i < 6; i++ ) {
+        _images[i] = _data + i*faceSize;
+    }
+}
+
+bool Cubemap::MipLevel::map( int fd, size_t offset, uint size, uint sample )
+{
+    release();
+
+    uint faceSize = size*size*sample;
+    size_t length = 6 * size_t( faceSize ) * sizeof( float );
+
+    // private mapping: pages are shared with the page cache until written
+    void* data = mmap( 0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset );
+    if ( data == MAP_FAILED )
+        return false;
+
+    _size = size;
+    _samplePerPixel = sample;
+    _data = static_cast<float*>( data );
+    _mappedLength = length;
+    for ( int i = 0; i < 6; i++ ) {
+        _images[i] = _data + i*faceSize;
+    }
+    return true;
+}
+
+void Cubemap::MipLevel::share( const MipLevel& level )
+{
+    release();
+
+    _size = level._size;
+    _samplePerPixel = level._samplePerPixel;
+    _data = const_cast<float*>( level._data );
+    _shared = true;
     for ( int i = 0; i < 6; i++ ) {
-        if (_images[i])
-            delete [] _images[i];
-        _images[i] = new float[size*size*sample];
+        _images[i] = const_cast<float*>( level._images[i] );
     }
 }
 
@@ -158,6 +272,87 @@ void EvalSHBasis(const float* dir, double* res )
 }
 
 
+// Same as EvalSHBasis for SH_LANES directions at once, stored as struct of
+// arrays so each coefficient is computed for all the lanes in a loop the
+// compiler turns into SIMD instructions. Results are identical to EvalSHBasis.
+#define SH_LANES 4
+
+struct SHBasisConstants {
+    double c0, c1, c4, c6, c8, c9, c10, c11, c12, c14, c16, c18, c19, c20;
+    SHBasisConstants() {
+        double SqrtPi = sqrt(PI);
+        c0 = (1/(2.*SqrtPi));
+        c1 = sqrt(3/PI);
+        c4 = sqrt(15/PI);
+        c6 = sqrt(5/PI);
+        c8 = sqrt(15/PI);
+        c9 = sqrt(35/(2.*PI));
+        c10 = sqrt(105/PI);
+        c11 = sqrt(21/(2.*PI));
+        c12 = sqrt(7/PI);
+        c14 = sqrt(105/PI);
+        c16 = sqrt(35/PI);
+        c18 = sqrt(5/PI);
+        c19 = sqrt(5/(2.*PI));
+        c20 = 16.*SqrtPi;
+    }
+};
+
+static const SHBasisConstants SHConstants;
+
+static CUBEMAP_FORCE_INLINE void EvalSHBasisLanes(const double* xx, const double* yy, const double* zz, double res[NUM_SH_COEFFICIENT][SH_LANES] )
+{
+    const SHBasisConstants& k = SHConstants;
+
+    double x2[SH_LANES], y2[SH_LANES], z2[SH_LANES];
+    double x3[SH_LANES], y3[SH_LANES];
+    double x4[SH_LANES], y4[SH_LANES], z4[SH_LANES];
+
+    for ( int l = 0; l < SH_LANES; l++ ) {
+        x2[l] = xx[l] * xx[l];
+        y2[l] = yy[l] * yy[l];
+        z2[l] = zz[l] * zz[l];
+        x3[l] = xx[l] * x2[l];
+        y3[l] = yy[l] * y2[l];
+        x4[l] = xx[l] * x3[l];
+        y4[l] = yy[l] * y3[l];
+        z4[l] = zz[l] * ( zz[l] * z2[l] );
+    }
+
+    for ( int l = 0; l < SH_LANES; l++ ) {
+        res[0][l]  = k.c0;
+
+        res[1][l]  = -(k.c1*yy[l])/2.;
+        res[2][l]  = (k.c1*zz[l])/2.;
+        res[3][l]  = -(k.c1*xx[l])/2.;
+
+        res[4][l]  = (k.c4*xx[l]*yy[l])/2.;
+        res[5][l]  = -(k.c4*yy[l]*zz[l])/2.;
+        res[6][l]  = (k.c6*(-1 + 3*z2[l]))/4.;
+        res[7][l]  = -(k.c4*xx[l]*zz[l])/2.;
+        res[8][l]  = k.c8*(x2[l] - y2[l])/4.;
+
+        res[9][l]  = (k.c9*(-3*x2[l]*yy[l] + y3[l]))/4.;
+        res[10][l] = (k.c10*xx[l]*yy[l]*zz[l])/2.;
+        res[11][l] = -(k.c11*yy[l]*(-1 + 5*z2[l]))/4.;
+        res[12][l] = (k.c12*zz[l]*(-3 + 5*z2[l]))/4.;
+        res[13][l] = -(k.c11*xx[l]*(-1 + 5*z2[l]))/4.;
+        res[14][l] = (k.c14*(x2[l] - y2[l])*zz[l])/4.;
+        res[15][l] = -(k.c9*(x3[l] - 3*xx[l]*y2[l]))/4.;
+
+        res[16][l] = (3*k.c16*xx[l]*yy[l]*(x2[l] - y2[l]))/4.;
+        res[17][l] = (-3*k.c9*(3*x2[l]*yy[l] - y3[l])*zz[l])/4.;
+        res[18][l] = (3*k.c18*xx[l]*yy[l]*(-1 + 7*z2[l]))/4.;
+        res[19][l] = (-3*k.c19*yy[l]*zz[l]*(-3 + 7*z2[l]))/4.;
+        res[20][l] = (3*(3 - 30*z2[l] + 35*z4[l]))/(k.c20);
+        res[21][l] = (-3*k.c19*xx[l]*zz[l]*(-3 + 7*z2[l]))/4.;
+        res[22][l] = (3*k.c18*(x2[l] - y2[l])*(-1 + 7*z2[l]))/8.;
+        res[23][l] = (-3*k.c9*(x3[l] - 3*xx[l]*y2[l])*zz[l])/4.;
+        res[24][l] = (3*k.c16*(x4[l] - 6*x2[l]*y2[l] + y4[l]))/16.;
+    }
+}
+
+
 
 void Cubemap::getSample(const Vec3f& direction, Vec3f& color ) const
 {
@@ -187,12 +382,60 @@ void Cubemap::buildNormalizerSolidAngleCubemap(uint size, int fixup)
     _levels[0].buildNormalizerSolidAngleCubemap(size, fixup);
 }
 
+CubemapNormalizer::CubemapNormalizer( uint size, int fixup )
+{
+    _size = size;
+    _fixup = fixup;
+
+    // same computation than texelCoordToVectCubeMap
+    _coords.resize( size );
+    for ( uint i = 0; i < size; i++ ) {
+        float ui = float(i);
+        if ( fixup ) {
+            _coords[i] = (2.0f * ui / (size - 1.0f) ) - 1.0f;
+        } else {
+            _coords[i] = (2.0f * (ui + 0.5f) / size ) - 1.0f;
+        }
+    }
+
+    // solid angle is symmetric along the diagonal, compute one octant of
+    // the face and copy it to the other half of the quadrant
+    uint half = ( size + 1 ) / 2;
+    _solidAngles.resize( half * half );
+    for ( uint j = 0; j < half; j++ ) {
+        for ( uint i = 0; i <= j; i++ ) {
+            float solidAngle = texelPixelSolidAngleCubeMap( (float)i, (float)j, size );
+            _solidAngles[ j * half + i ] = solidAngle;
+            _solidAngles[ i * half + j ] = solidAngle;
+        }
+    }
+}
+
+const CubemapNormalizer& CubemapNormalizer::get( uint size, int fixup )
+{
+    typedef std::map< std::pair<uint, int>, CubemapNormalizer* > NormalizerMap;
+    static NormalizerMap normalizers;
+    static std::mutex mutex;
+
+    std::lock_guard<std::mutex> lock( mutex );
+    std::pair<uint, int> key( size, fixup ? 1 : 0 );
+    NormalizerMap::iterator it = normalizers.find( key );
+    if ( it != normalizers.end() )
+        return *it->second;
+
+    CubemapNormalizer* normalizer = new CubemapNormalizer( size, key.second );
+    normalizers[ key ] = normalizer;
+    return *normalizer;
+}
+
 void Cubemap::MipLevel::buildNormalizerSolidAngleCubemap(uint size, int fixup)
 {
 
     init(size, 4);
     uint iCubeFace, u, v;
 
+    const CubemapNormalizer& normalizer = CubemapNormalizer::get( size, fixup );
+
     //iterate over cube faces
     for (iCubeFace=0; iCubeFace<6; iCubeFace++) {
 
@@ -203,8 +446,8 @@ void Cubemap::MipLevel::buildNormalizerSolidAngleCubemap(uint size, int fixup)
 
             for(u=0; u < size; u++) {
 
-                texelCoordToVectCubeMap(iCubeFace, (float)u, (float)v, size, texelPtr, fixup);
-                *(texelPtr + 3) = texelCoordSolidAngle( (float)u, (float)v);
+                normalizer.getDirection( iCubeFace, u, v, texelPtr );
+                *(texelPtr + 3) = normalizer.getSolidAngle( u, v );
                 texelPtr += _samplePerPixel;
 
             }
@@ -213,24 +456,222 @@ void Cubemap::MipLevel::buildNormalizerSolidAngleCubemap(uint size, int fixup)
 }
 
 
-Cubemap* Cubemap::shFilterCubeMap(bool useSolidAngleWeighting, int fixup, int outputCubemapSize)
+// number of doubles of the partial sums of one row: SHr, SHg, SHb and the weight
+#define SH_ROW_SUM_SIZE ( 3 * NUM_SH_COEFFICIENT + 1 )
+
+// project one row of a face on the SH basis, sums are written in rowSum
+static CUBEMAP_FORCE_INLINE void shProjectRowImpl( const CubemapNormalizer& normalizer, uint face, uint y, const float* srcRow, uint srcChannels, uint size, bool useSolidAngleWeighting, double* rowSum )
+{
+    double SHr[NUM_SH_COEFFICIENT][SH_LANES];
+    double SHg[NUM_SH_COEFFICIENT][SH_LANES];
+    double SHb[NUM_SH_COEFFICIENT][SH_LANES];
+    double weightAccum[SH_LANES];
+    double SHdir[NUM_SH_COEFFICIENT][SH_LANES];
+    double xx[SH_LANES], yy[SH_LANES], zz[SH_LANES], weight[SH_LANES];
+    double R[SH_LANES], G[SH_LANES], B[SH_LANES];
+    float texelVect[3];
+
+    for ( int i = 0; i < NUM_SH_COEFFICIENT; i++ ) {
+        for ( int l = 0; l < SH_LANES; l++ ) {
+            SHr[i][l] = SHg[i][l] = SHb[i][l] = 0.0;
+        }
+    }
+    for ( int l = 0; l < SH_LANES; l++ )
+        weightAccum[l] = 0.0;
+
+    for ( uint x = 0; x < size; x += SH_LANES ) {
+
+        for ( uint l = 0; l < SH_LANES; l++ ) {
+            if ( x + l < size ) {
+                normalizer.getDirection( face, x + l, y, texelVect );
+                const float* texel = &srcRow[ srcChannels * ( x + l ) ];
+                xx[l] = texelVect[0];
+                yy[l] = texelVect[1];
+                zz[l] = texelVect[2];
+                weight[l] = useSolidAngleWeighting ? normalizer.getSolidAngle( x + l, y ) : 1.0;
+                R[l] = texel[0];
+                G[l] = texel[1];
+                B[l] = texel[2];
+            } else {
+                // padding, does not contribute
+                xx[l] = yy[l] = zz[l] = 0.0;
+                weight[l] = R[l] = G[l] = B[l] = 0.0;
+            }
+        }
+
+        EvalSHBasisLanes( xx, yy, zz, SHdir );
+
+        for ( int i = 0; i < NUM_SH_COEFFICIENT; i++ ) {
+            for ( int l = 0; l < SH_LANES; l++ ) {
+                SHr[i][l] += R[l] * SHdir[i][l] * weight[l];
+                SHg[i][l] += G[l] * SHdir[i][l] * weight[l];
+                SHb[i][l] += B[l] * SHdir[i][l] * weight[l];
+            }
+        }
+
+        for ( int l = 0; l < SH_LANES; l++ )
+            weightAccum[l] += weight[l];
+    }
+
+    // merge lanes always in the same order
+    for ( int i = 0; i < NUM_SH_COEFFICIENT; i++ ) {
+        double r = 0.0, g = 0.0, b = 0.0;
+        for ( int l = 0; l < SH_LANES; l++ ) {
+            r += SHr[i][l];
+            g += SHg[i][l];
+            b += SHb[i][l];
+        }
+        rowSum[i] = r;
+        rowSum[NUM_SH_COEFFICIENT + i] = g;
+        rowSum[2*NUM_SH_COEFFICIENT + i] = b;
+    }
+    double w = 0.0;
+    for ( int l = 0; l < SH_LANES; l++ )
+        w += weightAccum[l];
+    rowSum[3*NUM_SH_COEFFICIENT] = w;
+}
+
+// evaluate SH coefficients for one row of a face
+static CUBEMAP_FORCE_INLINE void shReconstructRowImpl( const CubemapNormalizer& normalizer, uint face, uint y, float* dstRow, uint dstChannels, uint size, const double* SHr, const double* SHg, const double* SHb )
 {
-    Cubemap* srcCubemap = this;
+    double SHdir[NUM_SH_COEFFICIENT][SH_LANES];
+    double xx[SH_LANES], yy[SH_LANES], zz[SH_LANES];
+    float texelVect[3];
+
+    for ( uint x = 0; x < size; x += SH_LANES ) {
+
+        for ( uint l = 0; l < SH_LANES; l++ ) {
+            normalizer.getDirection( face, std::min( x + l, size - 1 ), y, texelVect );
+            xx[l] = texelVect[0];
+            yy[l] = texelVect[1];
+            zz[l] = texelVect[2];
+        }
+
+        EvalSHBasisLanes( xx, yy, zz, SHdir );
+
+        for ( uint l = 0; l < SH_LANES && x + l < size; l++ ) {
+
+            // get color value
+            float R = 0.0f, G = 0.0f, B = 0.0f;
+
+            for (int i = 0; i < NUM_SH_COEFFICIENT; ++i)
+            {
+                R += (float)(SHr[i] * SHdir[i][l] * SHBandFactor[i]);
+                G += (float)(SHg[i] * SHdir[i][l] * SHBandFactor[i]);
+                B += (float)(SHb[i] * SHdir[i][l] * SHBandFactor[i]);
+            }
+
+            float* texel = &dstRow[ dstChannels * ( x + l ) ];
+            texel[0] = R;
+            texel[1] = G;
+            texel[2] = B;
+            if (dstChannels > 3)
+            {
+                texel[3] = 1.0f;
+            }
+        }
+    }
+}
+
+static void shProjectRow( const CubemapNormalizer& normalizer, uint face, uint y, const float* srcRow, uint srcChannels, uint size, bool useSolidAngleWeighting, double* rowSum )
+{
+    shProjectRowImpl( normalizer, face, y, srcRow, srcChannels, size, useSolidAngleWeighting, rowSum );
+}
+
+static void shReconstructRow( const CubemapNormalizer& normalizer, uint face, uint y, float* dstRow, uint dstChannels, uint size, const double* SHr, const double* SHg, const double* SHb )
+{
+    shReconstructRowImpl( normalizer, face, y, dstRow, dstChannels, size, SHr, SHg, SHb );
+}
+
+#if defined(CUBEMAP_HAS_AVX2_PATH)
+__attribute__((target("avx2")))
+static void shProjectRowAVX2( const CubemapNormalizer& normalizer, uint face, uint y, const float* srcRow, uint srcChannels, uint size, bool useSolidAngleWeighting, double* rowSum )
+{
+    shProjectRowImpl( normalizer, face, y, srcRow, srcChannels, size, useSolidAngleWeighting, rowSum );
+}
+
+__attribute__((target("avx2")))
+static void shReconstructRowAVX2( const CubemapNormalizer& normalizer, uint face, uint y, float* dstRow, uint dstChannels, uint size, const double* SHr, const double* SHg, const double* SHb )
+{
+    shReconstructRowImpl( normalizer, face, y, dstRow, dstChannels, size, SHr, SHg, SHb );
+}
+#endif
+
+// rows of the 6 faces are processed in parallel, each row writes its own
+// partial sums that are merged in row order after, so the result does not
+// depend on the number of threads
+struct SHProjectionWorker {
+    const Cubemap& _src;
+    const CubemapNormalizer& _normalizer;
+    bool _useSolidAngleWeighting;
+    double* _rowSums;
+
+    SHProjectionWorker( const Cubemap& src, const CubemapNormalizer& normalizer, bool useSolidAngleWeighting, double* rowSums ): _src(src), _normalizer(normalizer), _useSolidAngleWeighting(useSolidAngleWeighting), _rowSums(rowSums)
+    {
+    }
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        uint size = _src.getSize();
+        uint srcChannels = _src.getSamplePerPixel();
+
+        for ( uint row = r.begin(); row != r.end(); ++row ) {
+            uint face = row / size;
+            uint y = row % size;
+            const float* srcRow = &_src.getImages().imageFace(face)[ srcChannels * ( y * size ) ];
+            double* rowSum = &_rowSums[ row * SH_ROW_SUM_SIZE ];
+
+#if defined(CUBEMAP_HAS_AVX2_PATH)
+            if ( cpuHasAVX2() ) {
+                shProjectRowAVX2( _normalizer, face, y, srcRow, srcChannels, size, _useSolidAngleWeighting, rowSum );
+                continue;
+            }
+#endif
+            shProjectRow( _normalizer, face, y, srcRow, srcChannels, size, _useSolidAngleWeighting, rowSum );
+        }
+    }
+};
+
+struct SHReconstructionWorker {
+    Cubemap& _dst;
+    const CubemapNormalizer& _normalizer;
+    const double* _SHr;
+    const double* _SHg;
+    const double* _SHb;
+
+    SHReconstructionWorker( Cubemap& dst, const CubemapNormalizer& normalizer, const double* SHr, const double* SHg, const double* SHb ): _dst(dst), _normalizer(normalizer), _SHr(SHr), _SHg(SHg), _SHb(SHb)
+    {
+    }
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        uint size = _dst.getSize();
+        uint dstChannels = _dst.getSamplePerPixel();
+
+        for ( uint row = r.begin(); row != r.end(); ++row ) {
+            uint face = row / size;
+            uint y = row % size;
+            float* dstRow = &_dst.getImages().imageFace(face)[ dstChannels * ( y * size ) ];
+
+#if defined(CUBEMAP_HAS_AVX2_PATH)
+            if ( cpuHasAVX2() ) {
+                shReconstructRowAVX2( _normalizer, face, y, dstRow, dstChannels, size, _SHr, _SHg, _SHb );
+                continue;
+            }
+#endif
+            shReconstructRow( _normalizer, face, y, dstRow, dstChannels, size, _SHr, _SHg, _SHb );
+        }
+    }
+};
+
+
+Cubemap* Cubemap::shFilterCubeMap(bool useSolidAngleWeighting, int fixup, int outputCubemapSize) const
+{
+    const Cubemap* srcCubemap = this;
     Cubemap* dstCubemap = new Cubemap();
     dstCubemap->init(outputCubemapSize, 3 );
 
     int srcSize = srcCubemap->getSize();
     int dstSize = dstCubemap->getSize();
 
-    //pointers used to walk across the image surface
-    float *normCubeRowStartPtr;
-    float *srcCubeRowStartPtr;
-    float *dstCubeRowStartPtr;
-    float *texelVect;
-
-    const int srcCubeMapNumChannels	= srcCubemap->getSamplePerPixel();
-    const int dstCubeMapNumChannels	= dstCubemap->getSamplePerPixel(); //DstCubeImage[0].m_NumChannels;
-
     //First step - Generate SH coefficient for the diffuse convolution
 
     //Regenerate normalization cubemap
@@ -240,12 +681,8 @@ Cubemap* Cubemap::shFilterCubeMap(bool useSolidAngleWeighting, int fixup, int ou
     // 	m_NormCubeMap[iCubeFace].Clear();
     // }
 
-    Cubemap normCubemap = Cubemap();
-
     //Normalized vectors per cubeface and per-texel solid angle
-    normCubemap.buildNormalizerSolidAngleCubemap(srcCubemap->getSize(), fixup);
-
-    const int normCubeMapNumChannels = normCubemap.getSamplePerPixel(); // This need to be init here after the generation of m_NormCubeMap
+    const CubemapNormalizer& srcNormalizer = CubemapNormalizer::get( srcCubemap->getSize(), fixup );
 
     //This is a custom implementation of D3DXSHProjectCubeMap to avoid to deal with LPDIRECT3DSURFACE9 pointer
     //Use Sh order 2 for a total of 9 coefficient as describe in http://www.cs.berkeley.edu/~ravir/papers/envmap/
@@ -254,54 +691,25 @@ Cubemap* Cubemap::shFilterCubeMap(bool useSolidAngleWeighting, int fixup, int ou
     double SHr[NUM_SH_COEFFICIENT];
     double SHg[NUM_SH_COEFFICIENT];
     double SHb[NUM_SH_COEFFICIENT];
-    double SHdir[NUM_SH_COEFFICIENT];
 
     memset(SHr, 0, NUM_SH_COEFFICIENT * sizeof(double));
     memset(SHg, 0, NUM_SH_COEFFICIENT * sizeof(double));
     memset(SHb, 0, NUM_SH_COEFFICIENT * sizeof(double));
-    memset(SHdir, 0, NUM_SH_COEFFICIENT * sizeof(double));
 
     double weightAccum = 0.0;
-    double weight = 0.0;
 
-    for (int iFaceIdx = 0; iFaceIdx < 6; iFaceIdx++)
-    {
-        for (int y = 0; y < srcSize; y++)
-        {
-            normCubeRowStartPtr = &normCubemap.getImages().imageFace(iFaceIdx)[ normCubeMapNumChannels * (y * srcSize)];
-            srcCubeRowStartPtr	= &srcCubemap->getImages().imageFace(iFaceIdx)[ srcCubeMapNumChannels * (y * srcSize)];
+    std::vector<double> rowSums( 6 * srcSize * SH_ROW_SUM_SIZE );
+    parallel_for(tbb::blocked_range<uint>(0, 6 * srcSize), SHProjectionWorker( *srcCubemap, srcNormalizer, useSolidAngleWeighting, &rowSums[0] ) );
 
-            for (int x = 0; x < srcSize; x++)
-            {
-                //pointer to direction and solid angle in cube map associated with texel
-                texelVect = &normCubeRowStartPtr[normCubeMapNumChannels * x];
-
-                if( useSolidAngleWeighting )
-                {   //solid angle stored in 4th channel of normalizer/solid angle cube map
-                    weight = *(texelVect+3);
-                }
-                else
-                {   //all taps equally weighted
-                    weight = 1.0;
-                }
-
-                EvalSHBasis(texelVect, SHdir);
-
-                // Convert to double
-                double R = srcCubeRowStartPtr[(srcCubeMapNumChannels * x) + 0];
-                double G = srcCubeRowStartPtr[(srcCubeMapNumChannels * x) + 1];
-                double B = srcCubeRowStartPtr[(srcCubeMapNumChannels * x) + 2];
-
-                for (int i = 0; i < NUM_SH_COEFFICIENT; i++)
-                {
-                    SHr[i] += R * SHdir[i] * weight;
-                    SHg[i] += G * SHdir[i] * weight;
-                    SHb[i] += B * SHdir[i] * weight;
-                }
-
-                weightAccum += weight;
-            }
+    for ( int row = 0; row < 6 * srcSize; row++ ) {
+        const double* rowSum = &rowSums[ row * SH_ROW_SUM_SIZE ];
+        for (int i = 0; i < NUM_SH_COEFFICIENT; i++)
+        {
+            SHr[i] += rowSum[i];
+            SHg[i] += rowSum[NUM_SH_COEFFICIENT + i];
+            SHb[i] += rowSum[2*NUM_SH_COEFFICIENT + i];
         }
+        weightAccum += rowSum[3*NUM_SH_COEFFICIENT];
     }
 
     //Normalization - The sum of solid angle should be equal to the solid angle of the sphere (4 PI), so
@@ -324,69 +732,40 @@ Cubemap* Cubemap::shFilterCubeMap(bool useSolidAngleWeighting, int fixup, int ou
 
     //Normalized vectors per cubeface and per-texel solid angle
     //BuildNormalizerSolidAngleCubemap(DstCubeImage->m_Width, m_NormCubeMap, a_FixupType);
-    normCubemap.buildNormalizerSolidAngleCubemap(dstCubemap->getSize(), fixup );
+    const CubemapNormalizer& dstNormalizer = CubemapNormalizer::get( dstCubemap->getSize(), fixup );
 
 
     // dump spherical harmonics coefficient
     // shRGB[I] * BandFactor[I]
-    std::cout << "shR: [ " << SHr[0] * SHBandFactor[0];
+    // written at once, envProcess prints from other stages at the same time
+    std::stringstream sh;
+    sh << "shR: [ " << SHr[0] * SHBandFactor[0];
     for (int i = 1; i < NUM_SH_COEFFICIENT; ++i)
-        std::cout << ", " << SHr[i] * SHBandFactor[i];
-    std::cout << " ]" << std::endl;
+        sh << ", " << SHr[i] * SHBandFactor[i];
+    sh << " ]" << std::endl;
 
-    std::cout << "shG: [ " << SHg[0] * SHBandFactor[0];
+    sh << "shG: [ " << SHg[0] * SHBandFactor[0];
     for (int i = 1; i < NUM_SH_COEFFICIENT; ++i)
-        std::cout << ", " << SHg[i] * SHBandFactor[i];
-    std::cout << " ]" << std::endl;
+        sh << ", " << SHg[i] * SHBandFactor[i];
+    sh << " ]" << std::endl;
 
-    std::cout << "shB: [ " << SHb[0] * SHBandFactor[0];
+    sh << "shB: [ " << SHb[0] * SHBandFactor[0];
     for (int i = 0; i < NUM_SH_COEFFICIENT; ++i)
-        std::cout << ", " << SHb[i] * SHBandFactor[i];
-    std::cout << " ]" << std::endl;
+        sh << ", " << SHb[i] * SHBandFactor[i];
+    sh << " ]" << std::endl;
 
-    std::cout << std::endl;
+    sh << std::endl;
 
-    std::cout << "shCoef: [ " << SHr[0] * SHBandFactor[0] << ", " << SHg[0] * SHBandFactor[0] << ", " << SHb[0] * SHBandFactor[0];
+    sh << "shCoef: [ " << SHr[0] * SHBandFactor[0] << ", " << SHg[0] * SHBandFactor[0] << ", " << SHb[0] * SHBandFactor[0];
     for (int i = 1; i < NUM_SH_COEFFICIENT; ++i) {
-        std::cout << ", " << SHr[i] * SHBandFactor[i] << ", " << SHg[i] * SHBandFactor[i] << ", " << SHb[i] * SHBandFactor[i];
+        sh << ", " << SHr[i] * SHBandFactor[i] << ", " << SHg[i] * SHBandFactor[i] << ", " << SHb[i] * SHBandFactor[i];
     }
-    std::cout << " ]" << std::endl;
+    sh << " ]" << std::endl;
+    std::cout << sh.str() << std::flush;
 
 
-    for (int iFaceIdx = 0; iFaceIdx < 6; iFaceIdx++)
-    {
-        for (int y = 0; y < dstSize; y++)
-        {
-            normCubeRowStartPtr = &normCubemap.getImages().imageFace(iFaceIdx)[normCubeMapNumChannels * (y * dstSize)];
-            dstCubeRowStartPtr	= &dstCubemap->getImages().imageFace(iFaceIdx)[dstCubeMapNumChannels * (y * dstSize)];
-
-            for (int x = 0; x < dstSize; x++)
-            {
-                //pointer to direction and solid angle in cube map associated with texel
-                texelVect = &normCubeRowStartPtr[normCubeMapNumChannels * x];
-
-                EvalSHBasis(texelVect, SHdir);
+    parallel_for(tbb::blocked_range<uint>(0, 6 * dstSize), SHReconstructionWorker( *dstCubemap, dstNormalizer, SHr, SHg, SHb ) );
 
-                // get color value
-                float R = 0.0f, G = 0.0f, B = 0.0f;
-
-                for (int i = 0; i < NUM_SH_COEFFICIENT; ++i)
-                {
-                    R += (float)(SHr[i] * SHdir[i] * SHBandFactor[i]);
-                    G += (float)(SHg[i] * SHdir[i] * SHBandFactor[i]);
-                    B += (float)(SHb[i] * SHdir[i] * SHBandFactor[i]);
-                }
-
-                dstCubeRowStartPtr[(dstCubeMapNumChannels * x) + 0] = R;
-                dstCubeRowStartPtr[(dstCubeMapNumChannels * x) + 1] = G;
-                dstCubeRowStartPtr[(dstCubeMapNumChannels * x) + 2] = B;
-                if (dstCubeMapNumChannels > 3)
-                {
-                    dstCubeRowStartPtr[(dstCubeMapNumChannels * x) + 3] = 1.0f;
-                }
-            }
-        }
-    }
     return dstCubemap;
 }
 
@@ -482,10 +861,170 @@ bool Cubemap::MipLevel::load(const std::string& name)
 
 bool Cubemap::load(const std::string& filename)
 {
+    size_t extension = filename.rfind( ".cbm" );
+    if ( extension != std::string::npos && extension == filename.size() - 4 )
+        return loadCache( filename );
+
     return _levels[0].load( filename );
 }
 
 
+// cache file layout, all the values are native endian:
+// header then each level on a page boundary, a level is the 6 faces of
+// size x size x samplePerPixel floats
+// the last byte of the magic is the version of the layout
+static const char CacheMagic[4] = { 'C', 'B', 'M', '1' };
+static const uint CacheMaxLevels = 30;
+static const uint CacheMaxSize = 1 << 16;
+static const uint CacheMaxSamplePerPixel = 4;
+static const size_t CacheAlignment = 4096; // multiple of the page size on all targets we use
+
+struct CacheHeader {
+    char _magic[4];
+    uint32_t _numLevels;
+    uint32_t _samplePerPixel;
+    uint32_t _sizes[CacheMaxLevels];
+    uint64_t _offsets[CacheMaxLevels];
+};
+
+static size_t alignCacheOffset( size_t offset )
+{
+    return ( offset + CacheAlignment - 1 ) / CacheAlignment * CacheAlignment;
+}
+
+// the levels of the header must be in the file, aligned for mmap and
+// not overlap the header, else the mapping would fault on first access
+static bool checkCacheHeader( const CacheHeader& header, uint64_t fileSize, const std::string& filename )
+{
+    if ( memcmp( header._magic, CacheMagic, 3 ) != 0 ) {
+        std::cout << "error " << filename << " is not a cubemap cache file" << std::endl;
+        return false;
+    }
+
+    if ( header._magic[3] != CacheMagic[3] ) {
+        std::cout << "error " << filename << " has an unsupported cache version " << header._magic[3] << std::endl;
+        return false;
+    }
+
+    if ( header._numLevels == 0 || header._numLevels > CacheMaxLevels ||
+         header._samplePerPixel < 3 || header._samplePerPixel > CacheMaxSamplePerPixel ) {
+        std::cout << "error " << filename << " has an invalid cache header" << std::endl;
+        return false;
+    }
+
+    // the sampling of the mip levels expects a chain
+    for ( uint i = 1; i < header._numLevels; i++ ) {
+        if ( header._sizes[i] != header._sizes[0] >> i ) {
+            std::cout << "error " << filename << " level " << i << " is not a mip level of " << header._sizes[0] << std::endl;
+            return false;
+        }
+    }
+
+    for ( uint i = 0; i < header._numLevels; i++ ) {
+        uint64_t size = header._sizes[i];
+        uint64_t offset = header._offsets[i];
+        uint64_t length = 6 * size * size * header._samplePerPixel * sizeof( float );
+
+        if ( size == 0 || size > CacheMaxSize ||
+             offset % CacheAlignment != 0 || offset < sizeof( header ) ||
+             offset > fileSize || length > fileSize - offset ) {
+            std::cout << "error " << filename << " level " << i << " is truncated or corrupted" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Cubemap::writeCache( const std::string& filename ) const
+{
+    CacheHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header._magic, CacheMagic, 4 );
+
+    uint numLevels = _levels.size();
+    if ( !numLevels ) {
+        std::cout << "error no cubemap to write " << filename << std::endl;
+        return false;
+    }
+    if ( numLevels > CacheMaxLevels ) {
+        std::cout << "error too many mip levels to write " << filename << std::endl;
+        return false;
+    }
+
+    header._numLevels = numLevels;
+    header._samplePerPixel = getSamplePerPixel();
+
+    size_t offset = alignCacheOffset( sizeof( header ) );
+    for ( uint i = 0; i < numLevels; i++ ) {
+        const MipLevel& level = _levels[i];
+        if ( level.getSamplePerPixel() != header._samplePerPixel ) {
+            std::cout << "error all the mip levels should have the same number of channels" << std::endl;
+            return false;
+        }
+        if ( level.getSize() != _levels[0].getSize() >> i ) {
+            std::cout << "error the levels of " << filename << " are not a mip chain" << std::endl;
+            return false;
+        }
+        header._sizes[i] = level.getSize();
+        header._offsets[i] = offset;
+        offset = alignCacheOffset( offset + 6 * size_t( level.getSize() ) * level.getSize() * level.getSamplePerPixel() * sizeof( float ) );
+    }
+
+    FILE* file = fopen( filename.c_str(), "wb" );
+    if ( !file ) {
+        std::cout << "error can't write " << filename << std::endl;
+        return false;
+    }
+
+    bool result = fwrite( &header, sizeof( header ), 1, file ) == 1;
+    for ( uint i = 0; result && i < numLevels; i++ ) {
+        const MipLevel& level = _levels[i];
+        result = fseek( file, header._offsets[i], SEEK_SET ) == 0 &&
+            fwrite( level._data, 6 * size_t( level.getSize() ) * level.getSize() * level.getSamplePerPixel() * sizeof( float ), 1, file ) == 1;
+    }
+
+    if ( fclose( file ) != 0 )
+        result = false;
+
+    if ( !result )
+        std::cout << "error while writing " << filename << std::endl;
+    return result;
+}
+
+bool Cubemap::loadCache( const std::string& filename )
+{
+    int fd = open( filename.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+
+    struct stat st;
+    CacheHeader header;
+    if ( fstat( fd, &st ) != 0 || read( fd, &header, sizeof( header ) ) != sizeof( header ) ) {
+        std::cout << "error " << filename << " is not a cubemap cache file" << std::endl;
+        close( fd );
+        return false;
+    }
+
+    if ( !checkCacheHeader( header, st.st_size, filename ) ) {
+        close( fd );
+        return false;
+    }
+
+    bool result = true;
+    _levels.resize( header._numLevels );
+    for ( uint i = 0; result && i < header._numLevels; i++ )
+        result = _levels[i].map( fd, header._offsets[i], header._sizes[i], header._samplePerPixel );
+
+    // the mappings stay valid after the file is closed
+    close( fd );
+
+    if ( !result )
+        std::cout << "error can't map " << filename << std::endl;
+    return result;
+}
+
+
 bool fileExist(const std::string& name) {
     struct stat buffer;
     return (stat (name.c_str(), &buffer) == 0);
@@ -505,67 +1044,23 @@ bool Cubemap::loadMipMap(const std::string& filenamePattern)
     }
 
     uint nbMipLevel = filenames.size();
+    if ( !nbMipLevel ) {
+        std::cout << "error no mip level found for " << filenamePattern << std::endl;
+        return false;
+    }
+
     uint size = pow(2, nbMipLevel-1 );
     std::cout << "found " << nbMipLevel << " mip level - " <<  size << " x " << size << " cubemap" << std::endl;
 
     _levels.resize(nbMipLevel);
     for ( uint i = 0 ; i < nbMipLevel; i++ ) {
-        _levels[i].load(filenames[i]);
-    }
-
-    return true;
-}
-
-void Cubemap::computePrefilteredEnvironmentUE4( const std::string& output, int startSize, int endSize, uint nbSamples, uint numRotations, const bool fixup ) {
-
-    int computeStartSize = startSize;
-    if (!computeStartSize)
-        computeStartSize = getSize();
-
-    int totalMipmap = log2(computeStartSize);
-    int endMipMap = totalMipmap - log2( endSize );
-#if 0
-    std::set<double> hamm;
-    for ( uint i = 0; i < 120000; i++ ) {
-        double v = radicalInverse_VdC(i);
-        if ( hamm.find(v) != hamm.end() ) {
-            std::cout << "entry " << v << " already in map" << std::endl;
-            hamm.insert(v);
+        if ( !_levels[i].load(filenames[i]) ) {
+            std::cout << "error can't read mip level " << filenames[i] << std::endl;
+            return false;
         }
     }
-#endif
 
-    std::cout << endMipMap + 1 << " mipmap levels will be generated from " << computeStartSize << " x " << computeStartSize << " to " << endSize << " x " << endSize << std::endl;
-
-    float start = 0.0;
-    float stop = 1.0;
-
-    float step = (stop-start)*1.0/float(endMipMap);
-
-    for ( int i = 0; i < totalMipmap+1; i++ ) {
-        Cubemap cubemap;
-
-        // frostbite, lagarde paper p67
-        // http://www.frostbite.com/wp-content/uploads/2014/11/course_notes_moving_frostbite_to_pbr.pdf
-        float r = step * i;
-        //float roughnessLinear = r;
-        float roughnessLinear = r * r;
-
-        int size = pow(2, totalMipmap-i );
-        cubemap.init( size );
-
-        std::stringstream ss;
-        ss << output << "_" << i << ".tif";
-
-        // generate debug color cubemap after limit size
-        if ( i <= endMipMap ) {
-            std::cout << "compute level " << i << " with roughness " << roughnessLinear << " " << size << " x " << size << " to " << ss.str() << std::endl;
-            cubemap.computePrefilterCubemapAtLevel( roughnessLinear, *this, nbSamples, numRotations, fixup);
-        } else {
-            cubemap.fill(Vec4f(1.0,0.0,1.0,1.0));
-        }
-        cubemap.write( ss.str().c_str() );
-    }
+    return true;
 }
 
 void Cubemap::computePrefilterCubemapAtLevel( float roughnessLinear, const Cubemap& inputCubemap, uint nbSamples, uint numRotations, bool fixup ) {
@@ -575,14 +1070,15 @@ void Cubemap::computePrefilterCubemapAtLevel( float roughnessLinear, const Cubem
     if ( roughnessLinear == 0.0 )
         nbSamples = 1;
 
-    precomputedLightInLocalSpace( nbSamples, roughnessLinear, inputCubemap.getSize() );
+    GGXSampleSet samples( nbSamples, roughnessLinear, inputCubemap.getSize() );
+    RotationTable rotations( numRotations );
 
-    iterateOnFace(0, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
-    iterateOnFace(1, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
-    iterateOnFace(2, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
-    iterateOnFace(3, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
-    iterateOnFace(4, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
-    iterateOnFace(5, roughnessLinear, inputCubemap, nbSamples, numRotations, fixup);
+    iterateOnFace(0, samples, inputCubemap, rotations, fixup);
+    iterateOnFace(1, samples, inputCubemap, rotations, fixup);
+    iterateOnFace(2, samples, inputCubemap, rotations, fixup);
+    iterateOnFace(3, samples, inputCubemap, rotations, fixup);
+    iterateOnFace(4, samples, inputCubemap, rotations, fixup);
+    iterateOnFace(5, samples, inputCubemap, rotations, fixup);
 }
 
 
@@ -637,19 +1133,23 @@ void Cubemap::iterateOnFace( uint face, float roughnessLinear, const Cubemap& cu
 
 
 struct Prefilter {
-  static void inline pixelOperator(const Cubemap& cubemap, uint nbSamples, uint numRotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
-    result = cubemap.prefilterEnvMapUE4( direction, nbSamples, numRotations );
+  typedef GGXSampleSet SampleSet;
+  static void inline pixelOperator(const Cubemap& cubemap, const SampleSet& samples, const RotationTable& rotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
+    result = cubemap.prefilterEnvMapUE4( direction, samples, rotations );
     }
 };
 
 struct Background {
-  static void inline pixelOperator(const Cubemap& cubemap, uint nbSamples, uint numRotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
-      result = cubemap.averageEnvMap( direction, nbSamples, numRotations );
+  typedef ConeSampleSet SampleSet;
+  static void inline pixelOperator(const Cubemap& cubemap, const SampleSet& samples, const RotationTable& rotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
+      result = cubemap.averageEnvMap( direction, samples, rotations );
     }
 };
 
+template<typename S>
 struct Copy {
-  static void inline pixelOperator(const Cubemap& cubemap, uint nbSamples, uint numRotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
+  typedef S SampleSet;
+  static void inline pixelOperator(const Cubemap& cubemap, const SampleSet& samples, const RotationTable& rotations, uint nativeResolution, const Vec3f& direction, Vec3f& result ) {
         cubemap.getImages(nativeResolution).getSample( direction, result);
     }
 };
@@ -657,37 +1157,89 @@ struct Copy {
 template<typename T>
 struct Worker {
     uint _samplePerPixel, _size, _face, _fixup;
-    float _roughnessLinear;
-    uint _nbSamples;
-    uint _numRotations;
+    const typename T::SampleSet& _samples;
+    const RotationTable& _rotations;
     const Cubemap& _cubemap;
     uint _nativeResolution;
     float* _dataFace;
 
-  Worker(uint samplePerPixel, uint size, uint face, bool fixup, float roughnessLinear, uint nbSamples, uint numRotations, const Cubemap& cubemap, uint nativeResolution, float* dataFace): _samplePerPixel(samplePerPixel),_size(size), _face(face), _fixup(fixup ? 1 : 0), _roughnessLinear(roughnessLinear), _nbSamples(nbSamples), _numRotations(numRotations), _cubemap(cubemap), _nativeResolution(nativeResolution), _dataFace(dataFace)
+  Worker(uint samplePerPixel, uint size, uint face, bool fixup, const typename T::SampleSet& samples, const RotationTable& rotations, const Cubemap& cubemap, uint nativeResolution, float* dataFace): _samplePerPixel(samplePerPixel),_size(size), _face(face), _fixup(fixup ? 1 : 0), _samples(samples), _rotations(rotations), _cubemap(cubemap), _nativeResolution(nativeResolution), _dataFace(dataFace)
     {
     }
 
+    void processRow( uint j ) const {
+
+        int lineIndex = j*_samplePerPixel*_size;
+
+        for ( uint i = 0; i < _size; i++ ) {
+
+            Vec3f direction, resultColor;
+            int index = lineIndex + i*_samplePerPixel;
+
+            texelCoordToVectCubeMap( _face, float(i), float(j), _size, &direction[0], _fixup );
+
+            T::pixelOperator(_cubemap, _samples, _rotations, _nativeResolution, direction, resultColor);
+
+            _dataFace[ index     ] = resultColor[0];
+            _dataFace[ index + 1 ] = resultColor[1];
+            _dataFace[ index + 2 ] = resultColor[2];
+        }
+    }
+
     void operator()(const tbb::blocked_range<uint>& r) const {
 
         for ( uint j = r.begin(); j != r.end(); ++j ) {
+            processRow( j );
+        }
+    }
+};
 
-            int lineIndex = j*_samplePerPixel*_size;
+// one prefiltered level in the global row space of PrefilterChainWorker
+// a level of size N owns 6*N rows starting at _rowStart ( face by face )
+struct PrefilterLevelTask {
+    Cubemap* _cubemap;
+    const GGXSampleSet* _samples;
+    uint _nativeResolution;
+    uint _rowStart;
+};
 
-            for ( uint i = 0; i < _size; i++ ) {
+struct PrefilterChainWorker {
+    const std::vector<PrefilterLevelTask>& _tasks;
+    const Cubemap& _input;
+    const RotationTable& _rotations;
+    bool _fixup;
 
-                Vec3f direction, resultColor;
-                int index = lineIndex + i*_samplePerPixel;
+    PrefilterChainWorker( const std::vector<PrefilterLevelTask>& tasks, const Cubemap& input, const RotationTable& rotations, bool fixup ): _tasks(tasks), _input(input), _rotations(rotations), _fixup(fixup)
+    {
+    }
 
-                texelCoordToVectCubeMap( _face, float(i), float(j), _size, &direction[0], _fixup );
+    void operator()(const tbb::blocked_range<uint>& r) const {
 
-                T::pixelOperator(_cubemap, _nbSamples, _numRotations, _nativeResolution, direction, resultColor);
+        // find the level of the first row, rows are sorted by level
+        uint t = 0;
+        while ( t + 1 < _tasks.size() && _tasks[t+1]._rowStart <= r.begin() )
+            t++;
 
-                _dataFace[ index     ] = resultColor[0];
-                _dataFace[ index + 1 ] = resultColor[1];
-                _dataFace[ index + 2 ] = resultColor[2];
-            }
+        for ( uint row = r.begin(); row != r.end(); ++row ) {
+
+            if ( t + 1 < _tasks.size() && _tasks[t+1]._rowStart <= row )
+                t++;
+
+            const PrefilterLevelTask& task = _tasks[t];
+            Cubemap& cubemap = *task._cubemap;
+            const GGXSampleSet& samples = *task._samples;
 
+            uint size = cubemap.getSize();
+            uint local = row - task._rowStart;
+            uint face = local / size;
+            uint j = local % size;
+            float* dataFace = cubemap.getImages().imageFace(face);
+
+            if ( samples.getRoughnessLinear() == 0.0 || samples.getNumSamples() == 1 ) {
+                Worker<Copy<GGXSampleSet> >(cubemap.getSamplePerPixel(), size, face, _fixup, samples, _rotations, _input, task._nativeResolution, dataFace).processRow( j );
+            } else {
+                Worker<Prefilter>(cubemap.getSamplePerPixel(), size, face, _fixup, samples, _rotations, _input, task._nativeResolution, dataFace).processRow( j );
+            }
         }
     }
 };
@@ -712,7 +1264,7 @@ struct Worker {
 //     }
 // };
 
-void Cubemap::iterateOnFace( uint face, float roughnessLinear, const Cubemap& cubemap, uint nbSamples, uint numRotations, bool fixup, bool backgroundAverage ) {
+uint Cubemap::findNativeResolution( const Cubemap& cubemap ) const {
 
     // find native resolution to copy pixel
     uint size = getSize();
@@ -723,27 +1275,150 @@ void Cubemap::iterateOnFace( uint face, float roughnessLinear, const Cubemap& cu
             break;
         }
     }
+    return nativeResolution;
+}
+
+void Cubemap::iterateOnFace( uint face, const GGXSampleSet& samples, const Cubemap& cubemap, const RotationTable& rotations, bool fixup ) {
+
+    uint size = getSize();
+    uint nativeResolution = findNativeResolution( cubemap );
     float* dataFace = getImages().imageFace(face);
 
-    if ( roughnessLinear == 0.0 || nbSamples ==1 ) {
-       parallel_for(tbb::blocked_range<uint>(0, size), Worker<Copy>(getSamplePerPixel(), size, face, fixup, 0.0, 1, 1, cubemap, nativeResolution, dataFace) );
+    if ( samples.getRoughnessLinear() == 0.0 || samples.getNumSamples() == 1 ) {
+       parallel_for(tbb::blocked_range<uint>(0, size), Worker<Copy<GGXSampleSet> >(getSamplePerPixel(), size, face, fixup, samples, rotations, cubemap, nativeResolution, dataFace) );
     } else {
-        if ( backgroundAverage )
-          parallel_for(tbb::blocked_range<uint>(0, size), Worker<Background>(getSamplePerPixel(), size, face, fixup, roughnessLinear, nbSamples, numRotations, cubemap, nativeResolution, dataFace) );
-        else
-          parallel_for(tbb::blocked_range<uint>(0, size), Worker<Prefilter>(getSamplePerPixel(), size, face, fixup, roughnessLinear, nbSamples, numRotations, cubemap, nativeResolution, dataFace) );
+       parallel_for(tbb::blocked_range<uint>(0, size), Worker<Prefilter>(getSamplePerPixel(), size, face, fixup, samples, rotations, cubemap, nativeResolution, dataFace) );
+    }
+}
+
+void Cubemap::iterateOnFace( uint face, const ConeSampleSet& samples, const Cubemap& cubemap, const RotationTable& rotations, bool fixup ) {
+
+    uint size = getSize();
+    uint nativeResolution = findNativeResolution( cubemap );
+    float* dataFace = getImages().imageFace(face);
+
+    if ( samples.getRadius() == 0.0 || samples.getNumSamples() == 1 ) {
+       parallel_for(tbb::blocked_range<uint>(0, size), Worker<Copy<ConeSampleSet> >(getSamplePerPixel(), size, face, fixup, samples, rotations, cubemap, nativeResolution, dataFace) );
+    } else {
+       parallel_for(tbb::blocked_range<uint>(0, size), Worker<Background>(getSamplePerPixel(), size, face, fixup, samples, rotations, cubemap, nativeResolution, dataFace) );
     }
 }
 
 #endif
 
-inline Vec3f rotateDirection(float angle, const Vec3f& l )
+void Cubemap::buildMipMap()
 {
-  float s,c,t;
+    uint size = getSize();
+    uint samplePerPixel = getSamplePerPixel();
+    uint nbLevels = uint( log2( size ) ) + 1;
+
+    _levels.resize( nbLevels );
+    for ( uint level = 1; level < nbLevels; level++ ) {
+        const MipLevel& src = _levels[level-1];
+        MipLevel& dst = _levels[level];
+        uint srcSize = src.getSize();
+        uint dstSize = srcSize / 2;
+        dst.init( dstSize, samplePerPixel );
+
+        for ( uint face = 0; face < 6; face++ ) {
+            const float* srcFace = src.imageFace( face );
+            float* dstFace = dst.imageFace( face );
+            for ( uint j = 0; j < dstSize; j++ ) {
+                for ( uint i = 0; i < dstSize; i++ ) {
+                    const float* p00 = srcFace + ( ( 2*j ) * srcSize + 2*i ) * samplePerPixel;
+                    const float* p10 = p00 + samplePerPixel;
+                    const float* p01 = p00 + srcSize * samplePerPixel;
+                    const float* p11 = p01 + samplePerPixel;
+                    float* out = dstFace + ( j * dstSize + i ) * samplePerPixel;
+                    for ( uint c = 0; c < samplePerPixel; c++ )
+                        out[c] = ( p00[c] + p10[c] + p01[c] + p11[c] ) * 0.25f;
+                }
+            }
+        }
+    }
+}
+
+void Cubemap::computePrefilteredEnvironmentUE4( const std::string& output, int startSize, int endSize, uint nbSamples, uint numRotations, const bool fixup ) const {
+
+    int computeStartSize = startSize;
+    if (!computeStartSize)
+        computeStartSize = getSize();
+
+    int totalMipmap = log2(computeStartSize);
+    int endMipMap = totalMipmap - log2( endSize );
+#if 0
+    std::set<double> hamm;
+    for ( uint i = 0; i < 120000; i++ ) {
+        double v = radicalInverse_VdC(i);
+        if ( hamm.find(v) != hamm.end() ) {
+            std::cout << "entry " << v << " already in map" << std::endl;
+            hamm.insert(v);
+        }
+    }
+#endif
+
+    std::cout << endMipMap + 1 << " mipmap levels will be generated from " << computeStartSize << " x " << computeStartSize << " to " << endSize << " x " << endSize << std::endl;
+
+    float start = 0.0;
+    float stop = 1.0;
+
+    float step = (stop-start)*1.0/float(endMipMap);
 
-  s = sin(angle);
-  c = cos(angle);
-  t = 1.f - c;
+    // all the levels are allocated and their samples computed first, then
+    // every ( level, face, row ) is processed by one parallel_for so small
+    // levels do not leave cores idle. Each texel is computed exactly like
+    // in computePrefilterCubemapAtLevel so the result does not change.
+    std::vector<Cubemap> cubemaps( totalMipmap+1 );
+    std::vector<GGXSampleSet> samples( totalMipmap+1 );
+    std::vector<PrefilterLevelTask> tasks;
+    uint totalRows = 0;
+
+    for ( int i = 0; i < totalMipmap+1; i++ ) {
+        Cubemap& cubemap = cubemaps[i];
+
+        // frostbite, lagarde paper p67
+        // http://www.frostbite.com/wp-content/uploads/2014/11/course_notes_moving_frostbite_to_pbr.pdf
+        float r = step * i;
+        //float roughnessLinear = r;
+        float roughnessLinear = r * r;
+
+        int size = pow(2, totalMipmap-i );
+        cubemap.init( size );
+
+        // generate debug color cubemap after limit size
+        if ( i <= endMipMap ) {
+            std::cout << "compute level " << i << " with roughness " << roughnessLinear << " " << size << " x " << size << std::endl;
+
+            roughnessLinear = clampTo(roughnessLinear, 0.0f, 1.0f);
+            samples[i].compute( roughnessLinear == 0.0 ? 1 : nbSamples, roughnessLinear, getSize() );
+
+            PrefilterLevelTask task;
+            task._cubemap = &cubemap;
+            task._samples = &samples[i];
+            task._nativeResolution = cubemap.findNativeResolution( *this );
+            task._rowStart = totalRows;
+            tasks.push_back( task );
+            totalRows += 6 * size;
+        } else {
+            cubemap.fill(Vec4f(1.0,0.0,1.0,1.0));
+        }
+    }
+
+    RotationTable rotations( numRotations );
+    parallel_for(tbb::blocked_range<uint>(0, totalRows), PrefilterChainWorker( tasks, *this, rotations, fixup ) );
+
+    for ( int i = 0; i < totalMipmap+1; i++ ) {
+        std::stringstream ss;
+        ss << output << "_" << i << ".tif";
+        std::cout << "write level " << i << " to " << ss.str() << std::endl;
+        cubemaps[i].write( ss.str().c_str() );
+    }
+}
+
+// rotate l around z, c and s are the cos / sin of the angle ( see RotationTable )
+inline Vec3f rotateDirection(float c, float s, const Vec3f& l )
+{
+  float t = 1.f - c;
 
   Vec3f L;
   L[0] =  l[0] * c  +  l[1] * s;
@@ -752,7 +1427,7 @@ inline Vec3f rotateDirection(float angle, const Vec3f& l )
   return L;
 }
 
-void Cubemap::computeBackground( const std::string& output, int startSize, uint nbSamples, uint numRotations, float radius , const bool fixup ) {
+void Cubemap::computeBackground( const std::string& output, int startSize, uint nbSamples, uint numRotations, float radius , const bool fixup, const bool fast ) {
 
     int computeStartSize = startSize;
     if (!computeStartSize)
@@ -776,25 +1451,35 @@ void Cubemap::computeBackground( const std::string& output, int startSize, uint
 
     // tbb::task_scheduler_init init(1);
 
-    precomputeUniformSampleOnCone( nbSamples, radius, sigmaSqr );
+    ConeSampleSet samples( nbSamples, radius, sigmaSqr );
+    RotationTable rotations( numRotations );
 
-    cubemap.iterateOnFace(0, radius, *this, nbSamples, numRotations, fixup, true);
-    cubemap.iterateOnFace(1, radius, *this, nbSamples, numRotations, fixup, true);
-    cubemap.iterateOnFace(2, radius, *this, nbSamples, numRotations, fixup, true);
-    cubemap.iterateOnFace(3, radius, *this, nbSamples, numRotations, fixup, true);
-    cubemap.iterateOnFace(4, radius, *this, nbSamples, numRotations, fixup, true);
-    cubemap.iterateOnFace(5, radius, *this, nbSamples, numRotations, fixup, true);
+    if ( fast ) {
+        if ( _levels.size() == 1 )
+            buildMipMap();
+        samples.setLod( samples.computeLod( numRotations, getSize() ) );
+        std::cout << "fast background using lod " << samples.getLod() << std::endl;
+    }
+
+    cubemap.iterateOnFace(0, samples, *this, rotations, fixup);
+    cubemap.iterateOnFace(1, samples, *this, rotations, fixup);
+    cubemap.iterateOnFace(2, samples, *this, rotations, fixup);
+    cubemap.iterateOnFace(3, samples, *this, rotations, fixup);
+    cubemap.iterateOnFace(4, samples, *this, rotations, fixup);
+    cubemap.iterateOnFace(5, samples, *this, rotations, fixup);
 
     cubemap.write( output.c_str() );
 }
 
-Vec3f Cubemap::prefilterEnvMapUE4( const Vec3f& R, const uint numSamples, const uint numRotations ) const
+Vec3f Cubemap::prefilterEnvMapUE4( const Vec3f& R, const GGXSampleSet& samples, const RotationTable& rotations ) const
 {
 
+    const uint numSamples = samples.getNumSamples();
+    const uint numRotations = rotations.getNumRotations();
+
     Vec3f N = R;
 
     Vec3d prefilteredColor = Vec3d(0,0,0);
-    Vec3f color;
     Vec3f colorSample;
 
     Vec3f UpVector = fabs(N[2]) < 0.999 ? Vec3f(0,0,1) : Vec3f(1,0,0);
@@ -804,126 +1489,134 @@ Vec3f Cubemap::prefilterEnvMapUE4( const Vec3f& R, const uint numSamples, const
     bool useLod = _levels.size() > 1;
 
 
-    float rad = 2.0*PI / float(numRotations);
+    float rad = rotations.getRadian();
     // offset rotation to avoid sampling pattern
     float gi = (float)(fabs(N[2] + N[0])*256.0);
     float offset = rad * ( cos( fmod(gi * 0.5f, 2.0f*PI ) ) * 0.5f + 0.5f );
+    float cosOffset = cos( offset );
+    float sinOffset = sin( offset );
+    float c, s;
 
-    // see getPrecomputedLightInLocalSpace in Math
+    // see GGXSampleSet in Math
     // and https://placeholderart.wordpress.com/2015/07/28/implementation-notes-runtime-environment-map-filtering-for-image-based-lighting/
     // for the simplification
 
     Vec3f LworldSpace;
 
-    if (useLod) {
-
-        // optimized lod version
-        for( uint i = 0; i < numSamples; i++ ) {
-            // vec4 contains the light vector + miplevel
-            const Vec4f& L = getPrecomputedLightInLocalSpace( i );
-            const Vec3f& LDir = Vec3f(L[0],L[1],L[2]);
-            colorSample = Vec3f(0,0,0);
-
-            float precomputedLod = L[3];
-            float NoL = L[2];
-            LworldSpace = TangentX * L[0] + TangentY * L[1] + N * L[2];
-
-            getSampleLOD( precomputedLod, LworldSpace, color );
+    // all the rotations of a light sample are fetched in one batch, colors
+    // are then accumulated in the same order than the scalar version
+    float dirX[SampleBatchSize], dirY[SampleBatchSize], dirZ[SampleBatchSize];
+    float r[SampleBatchSize], g[SampleBatchSize], b[SampleBatchSize];
 
-            colorSample += color;
-
-            for ( uint rotation = 1; rotation < numRotations; rotation++ ) {
+    for( uint i = 0; i < numSamples; i++ ) {
+        // vec4 contains the light vector + miplevel
+        const Vec4f& L = samples.getSample( i );
+        const Vec3f& LDir = Vec3f(L[0],L[1],L[2]);
+        colorSample = Vec3f(0,0,0);
 
-              Vec3f L2 = rotateDirection( offset + rotation*rad, LDir );
+        float precomputedLod = L[3];
+        float NoL = L[2];
 
-              LworldSpace = TangentX * L2[0] + TangentY * L2[1] + N * L2[2];
-              getSampleLOD( precomputedLod, LworldSpace, color );
-              colorSample += color;
+        for ( uint rotationStart = 0; rotationStart < numRotations; rotationStart += SampleBatchSize ) {
+            uint batch = std::min( SampleBatchSize, numRotations - rotationStart );
 
+            for ( uint k = 0; k < batch; k++ ) {
+                uint rotation = rotationStart + k;
+                if ( rotation == 0 ) {
+                    LworldSpace = TangentX * L[0] + TangentY * L[1] + N * L[2];
+                } else {
+                    rotations.getRotation( rotation, cosOffset, sinOffset, c, s );
+                    Vec3f L2 = rotateDirection( c, s, LDir );
+                    LworldSpace = TangentX * L2[0] + TangentY * L2[1] + N * L2[2];
+                }
+                dirX[k] = LworldSpace[0];
+                dirY[k] = LworldSpace[1];
+                dirZ[k] = LworldSpace[2];
             }
 
-            prefilteredColor += Vec3d(colorSample  * NoL);
-
-        }
-
-    } else {
-
-        // no lod version
-        for( uint i = 0; i < numSamples; i++ ) {
-            // vec4 contains the light vector + miplevel
-            const Vec4f& L = getPrecomputedLightInLocalSpace( i );
-            const Vec3f& LDir = Vec3f(L[0],L[1],L[2]);
-            float NoL = L[2];
-            colorSample = Vec3f(0,0,0);
-            LworldSpace = TangentX * L[0] + TangentY * L[1] + N * L[2];
-
-            getSample( LworldSpace, color );
-
-            colorSample += color;
-
-            for ( uint rotation = 1; rotation < numRotations; rotation++ ) {
-
-              Vec3f L2 = rotateDirection( offset + rotation*rad, LDir );
-
-              LworldSpace = TangentX * L2[0] + TangentY * L2[1] + N * L2[2];
-              getSample( LworldSpace, color );
-              colorSample += color;
+            if ( useLod )
+                getSamplesLOD( precomputedLod, dirX, dirY, dirZ, batch, r, g, b );
+            else
+                getSamples( dirX, dirY, dirZ, batch, r, g, b );
 
+            for ( uint k = 0; k < batch; k++ ) {
+                colorSample += Vec3f( r[k], g[k], b[k] );
             }
-
-            prefilteredColor += Vec3d(colorSample  * NoL);
-
         }
+
+        prefilteredColor += Vec3d(colorSample  * NoL);
     }
 
-    return prefilteredColor / ( getPrecomputedLightTotalWeight() * numRotations );
+    return prefilteredColor / ( samples.getTotalWeight() * numRotations );
 }
 
 
 // same but do a average to compute the background blur
-Vec3f Cubemap::averageEnvMap( const Vec3f& R, const uint numSamples, const uint numRotations ) const {
+Vec3f Cubemap::averageEnvMap( const Vec3f& R, const ConeSampleSet& samples, const RotationTable& rotations ) const {
+
+    const uint numSamples = samples.getNumSamples();
+    const uint numRotations = rotations.getNumRotations();
 
     Vec3f N = R;
     Vec3d prefilteredColor = Vec3d(0,0,0);
-    Vec3f color, colorSample, direction;
+    Vec3f colorSample, direction;
 
     Vec3f UpVector = fabs(N[2]) < 0.999 ? Vec3f(0,0,1) : Vec3f(1,0,0);
     Vec3f TangentX = normalize( cross( UpVector, N ) );
     Vec3f TangentY = normalize( cross( N, TangentX ) );
 
-    float rad = 2.0*PI / float(numRotations);
-    // offset rotation to avoid sampling pattern
-    float gi = (float)(fabs(N[2] + N[0])*256);
-    float offset = rad * ( cos( fmod(gi * 0.5f, 2.0f*PI ) ) * 0.5f + 0.5f );
-    offset = 0.0;
-    //std::cout << rad << std::endl;
+    bool useLod = samples.getLod() > 0.0 && _levels.size() > 1;
+
+    // no offset rotation for the background
+    // float rad = rotations.getRadian();
+    // float gi = (float)(fabs(N[2] + N[0])*256);
+    // float offset = rad * ( cos( fmod(gi * 0.5f, 2.0f*PI ) ) * 0.5f + 0.5f );
+    float cosOffset = 1.0;
+    float sinOffset = 0.0;
+    float c, s;
+
+    float dirX[SampleBatchSize], dirY[SampleBatchSize], dirZ[SampleBatchSize];
+    float r[SampleBatchSize], g[SampleBatchSize], b[SampleBatchSize];
 
     for( uint i = 0; i < numSamples; i++ ) {
 
         // vec4 contains direction and weight
-        const Vec4f& H =  getUniformSampleOnCone( i );
+        const Vec4f& H =  samples.getSample( i );
         const Vec3f& HDir = Vec3f(H[0], H[1], H[2]);
         colorSample = Vec3f(0,0,0);
 
-        // localspace to world space
-        direction = TangentX * H[0] + TangentY * H[1] + N * H[2];
-        getSample( direction, color );
-        colorSample += color;
+        for ( uint rotationStart = 0; rotationStart < numRotations; rotationStart += SampleBatchSize ) {
+            uint batch = std::min( SampleBatchSize, numRotations - rotationStart );
+
+            for ( uint k = 0; k < batch; k++ ) {
+                uint rotation = rotationStart + k;
+                if ( rotation == 0 ) {
+                    // localspace to world space
+                    direction = TangentX * H[0] + TangentY * H[1] + N * H[2];
+                } else {
+                    rotations.getRotation( rotation, cosOffset, sinOffset, c, s );
+                    Vec3f H2 = rotateDirection( c, s, HDir );
+                    direction = TangentX * H2[0] + TangentY * H2[1] + N * H2[2];
+                }
+                dirX[k] = direction[0];
+                dirY[k] = direction[1];
+                dirZ[k] = direction[2];
+            }
 
-        for ( uint rotation = 1; rotation < numRotations; rotation++ ) {
-          float angle = offset + rotation*rad;
-          Vec3f H2 = rotateDirection( angle, HDir );
-          //std::cout << "rotation " << rotation << " " << angle  << " [ " << H2[0] << ", " << H2[1] << ", " << H2[2] << " ] end"<< std::endl;
-          direction = TangentX * H2[0] + TangentY * H2[1] + N * H2[2];
-          getSample( direction, color );
-          colorSample += color;
+            if ( useLod )
+                getSamplesLOD( samples.getLod(), dirX, dirY, dirZ, batch, r, g, b );
+            else
+                getSamples( dirX, dirY, dirZ, batch, r, g, b );
 
+            for ( uint k = 0; k < batch; k++ ) {
+                colorSample += Vec3f( r[k], g[k], b[k] );
+            }
         }
 
         prefilteredColor += colorSample * H[3];
     }
 
-    return prefilteredColor / (getUniformSampleOnConeWeightSum() * numRotations );
+    return prefilteredColor / (samples.getWeightSum() * numRotations );
 }
 
 
@@ -1014,6 +1707,276 @@ void Cubemap::MipLevel::getSample(const Vec3f& direction, Vec3f& color ) const {
 }
 
 
+// Batch version of MipLevel::getSample
+// The SIMD paths reproduce vectToTexelCoordCubeMap operation by operation
+// ( float division by the major axis, texel coordinates computed in double
+// then converted to float, round to nearest like lrintf ) so each direction
+// gives exactly the same texel as the scalar code.
+// Faces are contiguous in memory so a texel is fetched with a single index
+// from _images[0].
+// Directions that can't be converted to a texel ( NaN, eg 1x1 level with
+// fixup ) are sent to the scalar code to keep its exact behavior.
+
+#if defined(__SSE2__)
+
+// compute face, and texel coordinates u v rounded to integer of 4 directions
+static inline void vectToTexelCoordCubeMapSSE2( __m128 dx, __m128 dy, __m128 dz, uint size, __m128i& face, __m128i& i0, __m128i& j0 )
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 ax = _mm_andnot_ps( signMask, dx );
+    __m128 ay = _mm_andnot_ps( signMask, dy );
+    __m128 az = _mm_andnot_ps( signMask, dz );
+
+    // same tests than vectToTexelCoordGeneric to select the major axis
+    __m128 yGtX = _mm_cmpgt_ps( ay, ax );
+    __m128 zGtY = _mm_cmpgt_ps( az, ay );
+    __m128 zGtX = _mm_cmpgt_ps( az, ax );
+    __m128 isY = _mm_andnot_ps( zGtY, yGtX );
+    __m128 isZ = _mm_or_ps( _mm_and_ps( yGtX, zGtY ), _mm_andnot_ps( yGtX, zGtX ) );
+    __m128 isX = _mm_andnot_ps( _mm_or_ps( isY, isZ ), _mm_castsi128_ps( _mm_set1_epi32(-1) ) );
+
+    __m128 bestValue = _mm_or_ps( _mm_or_ps( _mm_and_ps( isX, dx ), _mm_and_ps( isY, dy ) ), _mm_and_ps( isZ, dz ) );
+    __m128 positive = _mm_cmpgt_ps( bestValue, zero );
+    __m128 denom = _mm_andnot_ps( signMask, bestValue );
+
+    __m128 x = _mm_div_ps( dx, denom );
+    __m128 y = _mm_div_ps( dy, denom );
+    __m128 z = _mm_div_ps( dz, denom );
+
+    // see CubemapFace in Math
+    // +x: sc -z tc -y, -x: sc z tc -y
+    // +y: sc x tc z, -y: sc x tc -z
+    // +z: sc x tc -y, -z: sc -x tc -y
+    __m128 negX = _mm_xor_ps( x, signMask );
+    __m128 negY = _mm_xor_ps( y, signMask );
+    __m128 negZ = _mm_xor_ps( z, signMask );
+
+    __m128 scX = _mm_or_ps( _mm_and_ps( positive, negZ ), _mm_andnot_ps( positive, z ) );
+    __m128 scZ = _mm_or_ps( _mm_and_ps( positive, x ), _mm_andnot_ps( positive, negX ) );
+    __m128 tcY = _mm_or_ps( _mm_and_ps( positive, z ), _mm_andnot_ps( positive, negZ ) );
+
+    __m128 sc = _mm_or_ps( _mm_or_ps( _mm_and_ps( isX, scX ), _mm_and_ps( isY, x ) ), _mm_and_ps( isZ, scZ ) );
+    __m128 tc = _mm_or_ps( _mm_andnot_ps( isY, negY ), _mm_and_ps( isY, tcY ) );
+
+    // ppx = (sc + 1.0) * 0.5 * (width - 1) evaluated in double
+    const __m128d one = _mm_set1_pd( 1.0 );
+    const __m128d half = _mm_set1_pd( 0.5 );
+    const __m128d width = _mm_set1_pd( double(size - 1) );
+
+    __m128d scLo = _mm_mul_pd( _mm_mul_pd( _mm_add_pd( _mm_cvtps_pd( sc ), one ), half ), width );
+    __m128d scHi = _mm_mul_pd( _mm_mul_pd( _mm_add_pd( _mm_cvtps_pd( _mm_movehl_ps( sc, sc ) ), one ), half ), width );
+    __m128d tcLo = _mm_mul_pd( _mm_mul_pd( _mm_add_pd( _mm_cvtps_pd( tc ), one ), half ), width );
+    __m128d tcHi = _mm_mul_pd( _mm_mul_pd( _mm_add_pd( _mm_cvtps_pd( _mm_movehl_ps( tc, tc ) ), one ), half ), width );
+
+    __m128 u = _mm_movelh_ps( _mm_cvtpd_ps( scLo ), _mm_cvtpd_ps( scHi ) );
+    __m128 v = _mm_movelh_ps( _mm_cvtpd_ps( tcLo ), _mm_cvtpd_ps( tcHi ) );
+
+    // round to nearest like lrintf
+    i0 = _mm_cvtps_epi32( u );
+    j0 = _mm_cvtps_epi32( v );
+
+    // faceIndex = bestAxis*2 + ( positive ? 0 : 1 )
+    __m128i axis = _mm_or_si128( _mm_and_si128( _mm_castps_si128( isY ), _mm_set1_epi32(2) ),
+                                 _mm_and_si128( _mm_castps_si128( isZ ), _mm_set1_epi32(4) ) );
+    face = _mm_add_epi32( axis, _mm_andnot_si128( _mm_castps_si128( positive ), _mm_set1_epi32(1) ) );
+}
+
+static uint getSamplesSSE2( const Cubemap::MipLevel& level, const float* x, const float* y, const float* z, uint count, float* r, float* g, float* b )
+{
+    const uint size = level.getSize();
+    const uint samplePerPixel = level.getSamplePerPixel();
+    const uint faceStride = size*size*samplePerPixel;
+    const float* data = level.imageFace(0);
+
+    uint i = 0;
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m128i face, i0, j0;
+        vectToTexelCoordCubeMapSSE2( _mm_loadu_ps( x + i ), _mm_loadu_ps( y + i ), _mm_loadu_ps( z + i ), size, face, i0, j0 );
+
+        const __m128i invalid = _mm_set1_epi32( int(0x80000000) );
+        __m128i bad = _mm_or_si128( _mm_cmpeq_epi32( i0, invalid ), _mm_cmpeq_epi32( j0, invalid ) );
+        if ( _mm_movemask_epi8( bad ) ) {
+            Vec3f color;
+            for ( uint k = 0; k < 4; k++ ) {
+                level.getSample( Vec3f( x[i+k], y[i+k], z[i+k] ), color );
+                r[i+k] = color[0];
+                g[i+k] = color[1];
+                b[i+k] = color[2];
+            }
+            continue;
+        }
+
+        int faces[4], is[4], js[4];
+        _mm_storeu_si128( (__m128i*)faces, face );
+        _mm_storeu_si128( (__m128i*)is, i0 );
+        _mm_storeu_si128( (__m128i*)js, j0 );
+
+        for ( uint k = 0; k < 4; k++ ) {
+            const float* texel = data + faces[k]*faceStride + ( js[k] * size + is[k] ) * samplePerPixel;
+            r[i+k] = texel[0];
+            g[i+k] = texel[1];
+            b[i+k] = texel[2];
+        }
+    }
+    return i;
+}
+
+#if defined(CUBEMAP_HAS_AVX2_PATH)
+
+__attribute__((target("avx2")))
+static uint getSamplesAVX2( const Cubemap::MipLevel& level, const float* x, const float* y, const float* z, uint count, float* r, float* g, float* b )
+{
+    const uint size = level.getSize();
+    const uint samplePerPixel = level.getSamplePerPixel();
+    const float* data = level.imageFace(0);
+
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256d one = _mm256_set1_pd( 1.0 );
+    const __m256d half = _mm256_set1_pd( 0.5 );
+    const __m256d width = _mm256_set1_pd( double(size - 1) );
+    const __m256i faceStride = _mm256_set1_epi32( size*size*samplePerPixel );
+    const __m256i sizeVec = _mm256_set1_epi32( size );
+    const __m256i samplePerPixelVec = _mm256_set1_epi32( samplePerPixel );
+    const __m256i invalid = _mm256_set1_epi32( int(0x80000000) );
+
+    uint i = 0;
+    for ( ; i + 8 <= count; i += 8 ) {
+        __m256 dx = _mm256_loadu_ps( x + i );
+        __m256 dy = _mm256_loadu_ps( y + i );
+        __m256 dz = _mm256_loadu_ps( z + i );
+
+        __m256 ax = _mm256_andnot_ps( signMask, dx );
+        __m256 ay = _mm256_andnot_ps( signMask, dy );
+        __m256 az = _mm256_andnot_ps( signMask, dz );
+
+        __m256 yGtX = _mm256_cmp_ps( ay, ax, _CMP_GT_OQ );
+        __m256 zGtY = _mm256_cmp_ps( az, ay, _CMP_GT_OQ );
+        __m256 zGtX = _mm256_cmp_ps( az, ax, _CMP_GT_OQ );
+        __m256 isY = _mm256_andnot_ps( zGtY, yGtX );
+        __m256 isZ = _mm256_blendv_ps( zGtX, zGtY, yGtX );
+
+        __m256 bestValue = _mm256_blendv_ps( _mm256_blendv_ps( dx, dy, isY ), dz, isZ );
+        __m256 positive = _mm256_cmp_ps( bestValue, zero, _CMP_GT_OQ );
+        __m256 denom = _mm256_andnot_ps( signMask, bestValue );
+
+        __m256 nx = _mm256_div_ps( dx, denom );
+        __m256 ny = _mm256_div_ps( dy, denom );
+        __m256 nz = _mm256_div_ps( dz, denom );
+
+        __m256 negX = _mm256_xor_ps( nx, signMask );
+        __m256 negY = _mm256_xor_ps( ny, signMask );
+        __m256 negZ = _mm256_xor_ps( nz, signMask );
+
+        __m256 scX = _mm256_blendv_ps( nz, negZ, positive );
+        __m256 scZ = _mm256_blendv_ps( negX, nx, positive );
+        __m256 tcY = _mm256_blendv_ps( negZ, nz, positive );
+
+        __m256 sc = _mm256_blendv_ps( _mm256_blendv_ps( scX, nx, isY ), scZ, isZ );
+        __m256 tc = _mm256_blendv_ps( negY, tcY, isY );
+
+        __m256d scLo = _mm256_mul_pd( _mm256_mul_pd( _mm256_add_pd( _mm256_cvtps_pd( _mm256_castps256_ps128( sc ) ), one ), half ), width );
+        __m256d scHi = _mm256_mul_pd( _mm256_mul_pd( _mm256_add_pd( _mm256_cvtps_pd( _mm256_extractf128_ps( sc, 1 ) ), one ), half ), width );
+        __m256d tcLo = _mm256_mul_pd( _mm256_mul_pd( _mm256_add_pd( _mm256_cvtps_pd( _mm256_castps256_ps128( tc ) ), one ), half ), width );
+        __m256d tcHi = _mm256_mul_pd( _mm256_mul_pd( _mm256_add_pd( _mm256_cvtps_pd( _mm256_extractf128_ps( tc, 1 ) ), one ), half ), width );
+
+        __m256 u = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm256_cvtpd_ps( scLo ) ), _mm256_cvtpd_ps( scHi ), 1 );
+        __m256 v = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm256_cvtpd_ps( tcLo ) ), _mm256_cvtpd_ps( tcHi ), 1 );
+
+        __m256i i0 = _mm256_cvtps_epi32( u );
+        __m256i j0 = _mm256_cvtps_epi32( v );
+
+        __m256i bad = _mm256_or_si256( _mm256_cmpeq_epi32( i0, invalid ), _mm256_cmpeq_epi32( j0, invalid ) );
+        if ( !_mm256_testz_si256( bad, bad ) ) {
+            Vec3f color;
+            for ( uint k = 0; k < 8; k++ ) {
+                level.getSample( Vec3f( x[i+k], y[i+k], z[i+k] ), color );
+                r[i+k] = color[0];
+                g[i+k] = color[1];
+                b[i+k] = color[2];
+            }
+            continue;
+        }
+
+        __m256i axis = _mm256_or_si256( _mm256_and_si256( _mm256_castps_si256( isY ), _mm256_set1_epi32(2) ),
+                                        _mm256_and_si256( _mm256_castps_si256( isZ ), _mm256_set1_epi32(4) ) );
+        __m256i face = _mm256_add_epi32( axis, _mm256_andnot_si256( _mm256_castps_si256( positive ), _mm256_set1_epi32(1) ) );
+
+        __m256i index = _mm256_add_epi32( _mm256_mullo_epi32( face, faceStride ),
+                                          _mm256_mullo_epi32( _mm256_add_epi32( _mm256_mullo_epi32( j0, sizeVec ), i0 ), samplePerPixelVec ) );
+
+        _mm256_storeu_ps( r + i, _mm256_i32gather_ps( data, index, 4 ) );
+        _mm256_storeu_ps( g + i, _mm256_i32gather_ps( data + 1, index, 4 ) );
+        _mm256_storeu_ps( b + i, _mm256_i32gather_ps( data + 2, index, 4 ) );
+    }
+    return i;
+}
+
+#endif
+
+#endif
+
+void Cubemap::MipLevel::getSamples( const float* x, const float* y, const float* z, uint count, float* r, float* g, float* b ) const
+{
+    uint i = 0;
+
+#if defined(CUBEMAP_HAS_AVX2_PATH)
+    if ( cpuHasAVX2() )
+        i = getSamplesAVX2( *this, x, y, z, count, r, g, b );
+#endif
+
+#if defined(__SSE2__)
+    i += getSamplesSSE2( *this, x + i, y + i, z + i, count - i, r + i, g + i, b + i );
+#endif
+
+    Vec3f color;
+    for ( ; i < count; i++ ) {
+        getSample( Vec3f( x[i], y[i], z[i] ), color );
+        r[i] = color[0];
+        g[i] = color[1];
+        b[i] = color[2];
+    }
+}
+
+void Cubemap::getSamples( const float* x, const float* y, const float* z, uint count, float* r, float* g, float* b ) const
+{
+    _levels[0].getSamples( x, y, z, count, r, g, b );
+}
+
+void Cubemap::getSamplesLOD( float lod, const float* x, const float* y, const float* z, uint count, float* r, float* g, float* b ) const
+{
+    float l0 = floor( lod );
+    float l1 = ceil( lod );
+    float t = lod - l0;
+
+    float r1[SampleBatchSize], g1[SampleBatchSize], b1[SampleBatchSize];
+
+    _levels[int(l0)].getSamples( x, y, z, count, r, g, b );
+
+    for ( uint start = 0; start < count; start += SampleBatchSize ) {
+        uint batch = std::min( SampleBatchSize, count - start );
+
+        // when lod is an integer the two levels are the same, keep the lerp
+        // to have the same result than getSampleLOD
+        if ( l0 == l1 ) {
+            std::copy( r + start, r + start + batch, r1 );
+            std::copy( g + start, g + start + batch, g1 );
+            std::copy( b + start, b + start + batch, b1 );
+        } else {
+            _levels[int(l1)].getSamples( x + start, y + start, z + start, batch, r1, g1, b1 );
+        }
+
+        for ( uint i = 0; i < batch; i++ ) {
+            r[start+i] = r[start+i] + ( ( r1[i] - r[start+i] ) * t );
+            g[start+i] = g[start+i] + ( ( g1[i] - g[start+i] ) * t );
+            b[start+i] = b[start+i] + ( ( b1[i] - b[start+i] ) * t );
+        }
+    }
+}
+
+
 std::string getOutputImageFilename(int level, int index, const std::string& output) {
     std::stringstream ss;
     ss << output << "fixup_" << level << "_" << index << ".tif";
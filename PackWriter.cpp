@@ -0,0 +1,244 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#include <zlib.h>
+#include <tbb/parallel_for.h>
+
+#include "PackWriter"
+
+static const size_t BlockSize = 256 * 1024;
+static const size_t BlocksPerBatch = 16;
+static const size_t DictionarySize = 32 * 1024;
+
+// compresses one block of a batch, blocks of a batch are independent
+struct DeflateBlockWorker {
+    PackWriter::Batch& _batch;
+    int _level;
+
+    DeflateBlockWorker( PackWriter::Batch& batch, int level ): _batch(batch), _level(level) {}
+
+    void operator()(const tbb::blocked_range<size_t>& r) const {
+        size_t numBlocks = _batch._outputs.size();
+
+        for ( size_t block = r.begin(); block != r.end(); ++block ) {
+
+            size_t offset = block * BlockSize;
+            size_t size = _batch._sizes[block];
+            const unsigned char* input = _batch._input.empty() ? 0 : &_batch._input[offset];
+            bool last = _batch._last && block + 1 == numBlocks;
+
+            // the previous block in the batch or the tail of the previous batch
+            const unsigned char* dictionary = 0;
+            size_t dictionarySize = 0;
+            if ( block ) {
+                dictionarySize = DictionarySize;
+                dictionary = &_batch._input[offset - dictionarySize];
+            } else if ( !_batch._dictionary.empty() ) {
+                dictionarySize = _batch._dictionary.size();
+                dictionary = &_batch._dictionary[0];
+            }
+
+            _batch._crcs[block] = crc32( crc32( 0L, Z_NULL, 0 ), input, size );
+
+            z_stream stream;
+            memset( &stream, 0, sizeof( stream ) );
+            // negative window bits: raw deflate, the gzip wrapper is written once for the file
+            if ( deflateInit2( &stream, _level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+                _batch._ok = false;
+                continue;
+            }
+            if ( dictionarySize )
+                deflateSetDictionary( &stream, dictionary, dictionarySize );
+
+            std::vector<unsigned char>& output = _batch._outputs[block];
+            output.resize( deflateBound( &stream, size ) + 16 );
+
+            stream.next_in = (Bytef*)input;
+            stream.avail_in = size;
+            stream.next_out = &output[0];
+            stream.avail_out = output.size();
+
+            // sync flush ends the block on a byte boundary so the next one can follow
+            int result = deflate( &stream, last ? Z_FINISH : Z_SYNC_FLUSH );
+            // a full output buffer would mean the flush is not complete
+            if ( result == Z_STREAM_ERROR || stream.avail_in || !stream.avail_out || ( last && result != Z_STREAM_END ) )
+                _batch._ok = false;
+
+            output.resize( output.size() - stream.avail_out );
+            deflateEnd( &stream );
+        }
+    }
+};
+
+struct DeflateBatch {
+    PackWriter::Batch& _batch;
+    int _level;
+
+    DeflateBatch( PackWriter::Batch& batch, int level ): _batch(batch), _level(level) {}
+
+    void operator()() const {
+        tbb::parallel_for( tbb::blocked_range<size_t>( 0, _batch._outputs.size(), 1 ), DeflateBlockWorker( _batch, _level ) );
+    }
+};
+
+
+PackWriter::PackWriter(): _file(0), _compress(false), _level(9), _ok(false), _crc(0), _size(0), _filling(0), _pending(false)
+{
+}
+
+PackWriter::~PackWriter()
+{
+    if ( _file )
+        close();
+}
+
+bool PackWriter::open( const std::string& filename, bool compress, int level )
+{
+    if ( compress && ( level < 0 || level > 9 ) ) {
+        std::cout << "error gzip level " << level << " is not between 0 and 9" << std::endl;
+        _file = 0;
+        _ok = false;
+        return false;
+    }
+
+    _compress = compress;
+    _level = level;
+    _crc = crc32( 0L, Z_NULL, 0 );
+    _size = 0;
+    _filling = 0;
+    _pending = false;
+    _batches[0]._input.clear();
+    _batches[0]._dictionary.clear();
+
+    std::string name = compress ? filename + ".gz" : filename;
+    _file = fopen( name.c_str(), "wb" );
+    if ( !_file ) {
+        std::cout << "error can't write file " << name << std::endl;
+        _ok = false;
+        return false;
+    }
+
+    _ok = true;
+    if ( _compress ) {
+        // no name, no mtime, unix
+        unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        if ( level == 9 )
+            header[8] = 2; // best compression
+        else if ( level == 1 )
+            header[8] = 4; // fastest
+        _ok = fwrite( header, sizeof( header ), 1, _file ) == 1;
+    }
+    return _ok;
+}
+
+bool PackWriter::write( const void* data, size_t size )
+{
+    if ( !_file )
+        return false;
+
+    if ( !_compress ) {
+        if ( size && fwrite( data, size, 1, _file ) != 1 )
+            _ok = false;
+        return _ok;
+    }
+
+    const unsigned char* src = (const unsigned char*)data;
+    const size_t batchSize = BlockSize * BlocksPerBatch;
+
+    while ( size ) {
+        std::vector<unsigned char>& input = _batches[_filling]._input;
+        input.reserve( batchSize );
+        size_t count = std::min( size, batchSize - input.size() );
+        input.insert( input.end(), src, src + count );
+        src += count;
+        size -= count;
+
+        if ( input.size() == batchSize )
+            submit( false );
+    }
+    return _ok;
+}
+
+// starts the compression of the filling batch and writes the previous one
+void PackWriter::submit( bool last )
+{
+    finishPending();
+
+    Batch& batch = _batches[_filling];
+    size_t numBlocks = ( batch._input.size() + BlockSize - 1 ) / BlockSize;
+    if ( !numBlocks )
+        numBlocks = 1; // the last block can be empty, it ends the stream
+    batch._outputs.resize( numBlocks );
+    batch._crcs.resize( numBlocks );
+    batch._sizes.resize( numBlocks );
+    for ( size_t i = 0; i < numBlocks; i++ )
+        batch._sizes[i] = std::min( BlockSize, batch._input.size() - i * BlockSize );
+    batch._last = last;
+    batch._ok = true;
+
+    // the next batch is primed with the end of this one
+    Batch& next = _batches[1 - _filling];
+    next._input.clear();
+    if ( batch._input.size() >= DictionarySize )
+        next._dictionary.assign( batch._input.end() - DictionarySize, batch._input.end() );
+    else {
+        next._dictionary = batch._dictionary;
+        next._dictionary.insert( next._dictionary.end(), batch._input.begin(), batch._input.end() );
+        if ( next._dictionary.size() > DictionarySize )
+            next._dictionary.erase( next._dictionary.begin(), next._dictionary.end() - DictionarySize );
+    }
+
+    _group.run( DeflateBatch( batch, _level ) );
+    _pending = true;
+    _filling = 1 - _filling;
+}
+
+bool PackWriter::finishPending()
+{
+    if ( !_pending )
+        return _ok;
+
+    _group.wait();
+    _pending = false;
+
+    Batch& batch = _batches[1 - _filling];
+    if ( !batch._ok )
+        _ok = false;
+
+    for ( size_t i = 0; i < batch._outputs.size(); i++ ) {
+        std::vector<unsigned char>& output = batch._outputs[i];
+        if ( !output.empty() && fwrite( &output[0], output.size(), 1, _file ) != 1 )
+            _ok = false;
+        _crc = crc32_combine( _crc, batch._crcs[i], batch._sizes[i] );
+        _size += batch._sizes[i];
+        std::vector<unsigned char>().swap( output );
+    }
+    return _ok;
+}
+
+bool PackWriter::close()
+{
+    if ( !_file )
+        return false;
+
+    if ( _compress ) {
+        submit( true );
+        finishPending();
+
+        // crc and size modulo 2^32, little endian
+        unsigned char trailer[8];
+        for ( int i = 0; i < 4; i++ ) {
+            trailer[i] = ( _crc >> ( 8 * i ) ) & 0xff;
+            trailer[4 + i] = ( _size >> ( 8 * i ) ) & 0xff;
+        }
+        if ( fwrite( trailer, sizeof( trailer ), 1, _file ) != 1 )
+            _ok = false;
+    }
+
+    if ( fclose( _file ) != 0 )
+        _ok = false;
+    _file = 0;
+
+    return _ok;
+}
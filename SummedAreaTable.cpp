@@ -1,259 +1,399 @@
 #include <cassert>
+#include <cstring>
+#include <vector>
+#include <tbb/parallel_for.h>
 #include "SummedAreaTable"
 
-void SummedAreaTable::createLum(float* rgb, const uint width, const uint height, const uint nc)
-{
-    assert(nc > 2);
+// statistics of a row, rows are reduced in order after the parallel pass
+// so the result does not depend on the scheduling
+struct SatRowStats {
+    double _minLum, _maxLum;
+    double _minPonderedLum, _maxPonderedLum;
+    double _minR, _maxR;
+    double _minG, _maxG;
+    double _minB, _maxB;
+    double _weightAccum;
+    double _sum;
+};
+
+// pondered luminance and colors of the texels and row statistics
+// without normalizer the image is a panorama, else a cubemap face and the
+// texels are pondered by their solid angle
+struct SatWeightWorker {
+    const float* _rgb;
+    uint _width, _height, _nc;
+    const CubemapNormalizer* _normalizer;
+    SatTexel* _texels;
+    SatRowStats* _stats;
+
+    SatWeightWorker(const float* rgb, uint width, uint height, uint nc, const CubemapNormalizer* normalizer, SatTexel* texels, SatRowStats* stats):
+        _rgb(rgb), _width(width), _height(height), _nc(nc), _normalizer(normalizer), _texels(texels), _stats(stats)
+    {
+    }
 
-    _width = width;
-    _height = height;
+    void operator()(const tbb::blocked_range<uint>& range) const {
 
-    const uint imgSize = width * height;
+        const uint width = _width;
+        const uint height = _height;
+        // texels of the whole environment
+        const uint imgSize = _normalizer ? 6 * width * height : width * height;
 
-    _sat.clear();
-    _sat.resize(imgSize);
-    _sat1.clear();
-    _sat1.resize(imgSize);
-    _sat2.clear();
-    _sat2.resize(imgSize);
-    _sat3.clear();
-    _sat3.resize(imgSize);
-    _sat4.clear();
-    _sat4.resize(imgSize);
-    _sat5.clear();
-    _sat5.resize(imgSize);
-
-    _r.clear();
-    _r.resize(imgSize);
-    _g.clear();
-    _g.resize(imgSize);
-    _b.clear();
-    _b.resize(imgSize);
-
-    _sat[0] = 0.0;
-    _sat1[0] = 0.0;
-    _sat2[0] = 0.0;
-    _sat3[0] = 0.0;
-    _sat4[0] = 0.0;
-    _sat5[0] = 0.0;
-    _r[0] = 0.0;
-    _g[0] = 0.0;
-    _b[0] = 0.0;
+        // solid angle for 1 pixel on equi map
+        const double weight = (4.0 * PI) / ((double)(imgSize));
 
-    double weightAccum = 0.0;
+        for (uint y = range.begin(); y != range.end(); ++y) {
 
-    // solid angle for 1 pixel on equi map
-    double weight = (4.0 * PI) / ((double)(imgSize));
+            SatRowStats& stats = _stats[y];
+            stats._minLum = DBL_MAX;
+            stats._maxLum = DBL_MIN;
+            stats._minPonderedLum = DBL_MAX;
+            stats._maxPonderedLum = DBL_MIN;
+            stats._minR = DBL_MAX;
+            stats._maxR = DBL_MIN;
+            stats._minG = DBL_MAX;
+            stats._maxG = DBL_MIN;
+            stats._minB = DBL_MAX;
+            stats._maxB = DBL_MIN;
+            stats._weightAccum = 0.0;
+            stats._sum = 0.0;
 
-    Vec3f d;
-    uint faceIdx;
-    float aU, aV;
+            const double posY = (double)(y+1.0) / (double)(height+1.0);
 
+            // the latitude-longitude format overrepresents the area of regions near the poles.
+            // To compensate for this, the pixels of the probe image
+            // should first be scaled by cosφ.
+            // (φ == 0 at middle height of image input)
+            const double solidAngle = cos(PI* (posY - 0.5)) * weight;
 
-    _minLum = DBL_MAX;
-    _maxLum = DBL_MIN;
-    _minPonderedLum = DBL_MAX;
-    _maxPonderedLum = DBL_MIN;
-    _minR = DBL_MAX;
-    _maxR = DBL_MIN;
-    _minB = DBL_MAX;
-    _maxG = DBL_MIN;
-    _minB = DBL_MAX;
-    _maxB = DBL_MIN;
-    _sum = 0.0;
-    
-    for (uint y = 0; y < height; ++y) {
-        
-        const double posY = (double)(y+1.0) / (double)(height+1.0);
-
-        // the latitude-longitude format overrepresents the area of regions near the poles.
-        // To compensate for this, the pixels of the probe image
-        // should first be scaled by cosφ.
-        // (φ == 0 at middle height of image input)
-        const double solidAngle = cos(PI* (posY - 0.5)) * weight;
-
-        for (uint x = 0; x < width;  ++x) {
-
-            const uint i = y*width + x;
-
-            double r = rgb[i*nc + 0];
-            double g = rgb[i*nc + 1];
-            double b = rgb[i*nc + 2];
-
-            double ixy = luminance(r,g,b);
-
-            // update Min/Max before pondering            
-            _minLum = std::min(ixy, _minLum);
-            _maxLum = std::max(ixy, _maxLum);
-            
-            _minR = std::min(r, _minR);
-            _maxR = std::max(r, _maxR);
-            
-            _minG = std::min(g, _minG);
-            _maxG = std::max(g, _maxG);
-            
-            _minB = std::min(b, _minB);
-            _maxB = std::max(b, _maxB);
-
-#define _PONDER_REAL 
+            for (uint x = 0; x < width;  ++x) {
+
+                const uint i = y*width + x;
+
+                double r = _rgb[i*_nc + 0];
+                double g = _rgb[i*_nc + 1];
+                double b = _rgb[i*_nc + 2];
+
+                double ixy = luminance(r,g,b);
+
+                // update Min/Max before pondering
+                stats._minLum = std::min(ixy, stats._minLum);
+                stats._maxLum = std::max(ixy, stats._maxLum);
+
+                stats._minR = std::min(r, stats._minR);
+                stats._maxR = std::max(r, stats._maxR);
+
+                stats._minG = std::min(g, stats._minG);
+                stats._maxG = std::max(g, stats._maxG);
+
+                stats._minB = std::min(b, stats._minB);
+                stats._maxB = std::max(b, stats._maxB);
+
+                double pixelSolidAngle = solidAngle;
+
+#define _PONDER_REAL
 #ifdef _PONDER_REAL
 
-            
-            r *= solidAngle* imgSize;
-            g *= solidAngle* imgSize;
-            b *= solidAngle* imgSize;
-            
-            // ixy = luminance(r,g,b);
-            // pondering luminance for unpondered colors makes more sense
-            ixy *= solidAngle;
-            
+                if (_normalizer)
+                    pixelSolidAngle = _normalizer->getSolidAngle(x, y);
+
+                // ixy = luminance(r,g,b);
+                // pondering luminance for unpondered colors makes more sense
+                ixy *= pixelSolidAngle;
+
 #else
-            // complex approx going through cubemap conversion
-            
-            // convert panorama to direction x,y,z
-            //https://www.shadertoy.com/view/4dsGD2
-            double theta = (1.0 - posY) * PI;
-            double phi   = (double) x / (double)width * TAU;
-
-            // Equation from http://graphicscodex.com  [sphry]
-            d[0] =  sin(theta) * sin(phi);
-            d[1] =               cos(theta);
-            d[2] =  sin(theta) * cos(phi);
-            d.normalize();
-
-            vectToTexelCoordPanorama(d, width,  height, aU, aV ) ;
-            const double solidAngle = texelPixelSolidAnglePanorama(aU, aV, width,  height);
-
-            // Then compute the solid Angle of that thing
-            //const double solidAngle = texelPixelSolidAngle(x, y, width,  height);
-            ixy *= solidAngle;
-            //r *= solidAngle;
-            //g *= solidAngle;
-            //b *= solidAngle;
-            
+                // complex approx going through cubemap conversion
+
+                // convert panorama to direction x,y,z
+                //https://www.shadertoy.com/view/4dsGD2
+                double theta = (1.0 - posY) * PI;
+                double phi   = (double) x / (double)width * TAU;
+
+                // Equation from http://graphicscodex.com  [sphry]
+                Vec3f d;
+                d[0] =  sin(theta) * sin(phi);
+                d[1] =               cos(theta);
+                d[2] =  sin(theta) * cos(phi);
+                d.normalize();
+
+                float aU, aV;
+                vectToTexelCoordPanorama(d, width,  height, aU, aV ) ;
+                pixelSolidAngle = texelPixelSolidAnglePanorama(aU, aV, width,  height);
+
+                // Then compute the solid Angle of that thing
+                //const double solidAngle = texelPixelSolidAngle(x, y, width,  height);
+                ixy *= pixelSolidAngle;
+                //r *= solidAngle;
+                //g *= solidAngle;
+                //b *= solidAngle;
+
 #endif
-            
-            _sat[i] = ixy;
-
-            _r[i] = r;
-            _g[i] = g;
-            _b[i] = b;
-
-            //weightAccum += weight;
-            //weightAccum += 1.0;
-            weightAccum += solidAngle;
-            _sum += ixy;
-            
+
+                SatTexel& t = _texels[i];
+                t._sum = ixy;
+
+                t._r = r;
+                t._g = g;
+                t._b = b;
+
+                // min / max of the normalized values are the ones of the
+                // values scaled by the normalizer, it is positive
+                stats._minPonderedLum = std::min(ixy, stats._minPonderedLum);
+                stats._maxPonderedLum = std::max(ixy, stats._maxPonderedLum);
+
+                //weightAccum += weight;
+                //weightAccum += 1.0;
+                stats._weightAccum += pixelSolidAngle;
+                stats._sum += ixy;
+            }
         }
     }
-    // store for later use.
-    _weightAccum = weightAccum;
-    
-    bool normalize = true;
+};
+
+// normalizes the texels of a row and sums them along the row
+struct SatScanRowWorker {
+    uint _width;
+    SatTexel* _texels;
+    double _normalizer;
+    double _minPonderedLum, _rangePonderedLum;
+    double _minR, _rangeR;
+    double _minG, _rangeG;
+    double _minB, _rangeB;
+
+    SatScanRowWorker(uint width, SatTexel* texels, double normalizer,
+                     double minPonderedLum, double rangePonderedLum,
+                     double minR, double rangeR, double minG, double rangeG, double minB, double rangeB):
+        _width(width), _texels(texels), _normalizer(normalizer),
+        _minPonderedLum(minPonderedLum), _rangePonderedLum(rangePonderedLum),
+        _minR(minR), _rangeR(rangeR), _minG(minG), _rangeG(rangeG), _minB(minB), _rangeB(rangeB)
+    {
+    }
 
-    
-    if (normalize){
+    void operator()(const tbb::blocked_range<uint>& range) const {
 
-        // normalize in order our image Accumulation exactly match 4 PI.
-        const double normalizer = (4.0 * PI) / weightAccum;
+        for (uint y = range.begin(); y != range.end(); ++y) {
 
-        _sum *= normalizer;
-        
+            SatTexel* row = _texels + y*_width;
 
-        for (uint i = 0; i < imgSize; ++i) {
+            for (uint x = 0; x < _width; ++x) {
 
-            _sat[i] *= normalizer;
-            
-            _minPonderedLum = std::min(_sat[i], _minPonderedLum);
-            _maxPonderedLum = std::max(_sat[i], _maxPonderedLum);
-            
-        }
-    }
+                SatTexel& t = row[x];
+
+                // normalize in order our image Accumulation exactly match 4 PI.
+                t._sum *= _normalizer;
 
 #define ENHANCE_PRECISION 1
 #ifdef ENHANCE_PRECISION
 
-        // enhances precision of SAT
-        // make values be around [0.0, 0.5]
-        // https://developer.amd.com/wordpress/media/2012/10/SATsketch-siggraph05.pdf
-        const double rangeLum = _maxLum - _minLum;
-        const double rangePonderedLum = _maxPonderedLum -_minPonderedLum;        
-        const double rangeR = _maxR - _minR;
-        const double rangeG = _maxG - _minG;
-        const double rangeB = _maxB - _minB;
-        
-        for (uint i = 0; i< imgSize; ++i) {
-                
-            _sat[i] = ((_sat[i] - _minPonderedLum) / rangePonderedLum) * 0.5;
-            
-            _r[i]  = ((_r[i] - _minR) / rangeR) * 0.5;
-            _g[i]  = ((_g[i] - _minG) / rangeG) * 0.5;
-            _b[i]  = ((_b[i] - _minB) / rangeB) * 0.5;
-            
-        }
-#endif
-    
-        // now we sum
-        for (uint y = 0; y < height; ++y) {
-            for (uint x = 0; x < width;  ++x) {
-                const uint i = y*width + x;
-            
-                // https://en.wikipedia.org/wiki/Summed_area_table
-                _sat[i] = _sat[i] + I(x-1, y) + I(x, y-1) - I(x-1, y-1);
+                // enhances precision of SAT
+                // make values be around [0.0, 0.5]
+                // https://developer.amd.com/wordpress/media/2012/10/SATsketch-siggraph05.pdf
+                t._sum = ((t._sum - _minPonderedLum) / _rangePonderedLum) * 0.5;
 
-                _r[i]   = _r[i]   + R(x-1, y) + R(x, y-1) - R(x-1, y-1);
-                _g[i]   = _g[i]   + G(x-1, y) + G(x, y-1) - G(x-1, y-1);
-                _b[i]   = _b[i]   + B(x-1, y) + B(x, y-1) - B(x-1, y-1);
+                t._r  = ((t._r - _minR) / _rangeR) * 0.5;
+                t._g  = ((t._g - _minG) / _rangeG) * 0.5;
+                t._b  = ((t._b - _minB) / _rangeB) * 0.5;
+#endif
 
+                if (x) {
+                    const SatTexel& left = row[x-1];
+                    t._sum += left._sum;
+                    t._r   += left._r;
+                    t._g   += left._g;
+                    t._b   += left._b;
+                }
             }
         }
+    }
+};
 
+// log and powers of the luminance table summed along a row, they only read
+// the finished luminance table
+struct SatMomentRowWorker {
+    uint _width;
+    SatTexel* _texels;
 
-        // integral log
-        for (uint y = 0; y < _height; ++y)
-        {
-            for (uint x = 0; x < _width;  ++x)
-            {
-                const uint i = y*width + x;
+    SatMomentRowWorker(uint width, SatTexel* texels): _width(width), _texels(texels) {}
 
-                double sum = I(x, y);
-                if (sum > 0) sum = log(I(x, y));
+    void operator()(const tbb::blocked_range<uint>& range) const {
 
-                _sat1[i] = sum + I1(x-1, y) + I1(x, y-1) - I1(x-1, y-1);
-            }
-        }
+        for (uint y = range.begin(); y != range.end(); ++y) {
 
-        // Integral image of higher power
-        // http://vision.okstate.edu/pubs/ssiai_tp_1.pdf
-        // integral 2
-        for (uint y = 0; y < _height; ++y)
-        {
-            for (uint x = 0; x < _width;  ++x)
-            {
-                const uint i = y*width + x;
-                _sat2[i] = I(x, y)*I(x, y) + I2(x-1, y) + I2(x, y-1) - I2(x-1, y-1);
-            }
-        }
-        // integral 3
-        for (uint y = 0; y < _height; ++y) {
-            for (uint x = 0; x < _width;  ++x) {
-                const uint i = y*width + x;
-                _sat3[i] = I(x, y)*I(x, y)*I(x, y) + I3(x-1, y) + I3(x, y-1) - I3(x-1, y-1);
-            }
-        }
-        // integral 4
-        for (uint y = 0; y < _height; ++y) {
-            for (uint x = 0; x < _width;  ++x) {
-                const uint i = y*width + x;
-                _sat4[i] = I(x, y)*I(x, y)*I(x, y)*I(x, y) + I4(x-1, y) + I4(x, y-1) - I4(x-1, y-1);
+            SatTexel* row = _texels + y*_width;
+
+            for (uint x = 0; x < _width; ++x) {
+
+                SatTexel& t = row[x];
+                const double ixy = t._sum;
+
+                double sum = ixy;
+                if (sum > 0) sum = log(ixy);
+
+                // Integral image of higher power
+                // http://vision.okstate.edu/pubs/ssiai_tp_1.pdf
+                t._sum1 = sum;
+                t._sum2 = ixy*ixy;
+                t._sum3 = ixy*ixy*ixy;
+                t._sum4 = ixy*ixy*ixy*ixy;
+                t._sum5 = ixy*ixy*ixy*ixy;
+
+                if (x) {
+                    const SatTexel& left = row[x-1];
+                    t._sum1 += left._sum1;
+                    t._sum2 += left._sum2;
+                    t._sum3 += left._sum3;
+                    t._sum4 += left._sum4;
+                    t._sum5 += left._sum5;
+                }
             }
         }
-        // integral 5
-        for (uint y = 0; y < _height; ++y) {
-            for (uint x = 0; x < _width;  ++x) {
-                const uint i = y*width + x;
-                _sat5[i] = I(x, y)*I(x, y)*I(x, y)*I(x, y) + I5(x-1, y) + I5(x, y-1) - I5(x-1, y-1);
+    }
+};
+
+// adds the previous row to each row on a range of columns, after the row
+// scan it gives the summed area table
+struct SatScanColumnWorker {
+    uint _width, _height;
+    SatTexel* _texels;
+    bool _moments; // log and powers tables, else luminance and colors
+
+    SatScanColumnWorker(uint width, uint height, SatTexel* texels, bool moments):
+        _width(width), _height(height), _texels(texels), _moments(moments)
+    {
+    }
+
+    void operator()(const tbb::blocked_range<uint>& range) const {
+
+        for (uint y = 1; y < _height; ++y) {
+
+            SatTexel* row = _texels + y*_width;
+            const SatTexel* up = row - _width;
+
+            if (_moments) {
+                for (uint x = range.begin(); x != range.end(); ++x) {
+                    row[x]._sum1 += up[x]._sum1;
+                    row[x]._sum2 += up[x]._sum2;
+                    row[x]._sum3 += up[x]._sum3;
+                    row[x]._sum4 += up[x]._sum4;
+                    row[x]._sum5 += up[x]._sum5;
+                }
+            } else {
+                for (uint x = range.begin(); x != range.end(); ++x) {
+                    row[x]._sum += up[x]._sum;
+                    row[x]._r   += up[x]._r;
+                    row[x]._g   += up[x]._g;
+                    row[x]._b   += up[x]._b;
+                }
             }
         }
+    }
+};
+
+/**
+ * The tables are built with parallel passes: weighting of the rows, scan
+ * of the rows and scan of the columns for the luminance and colors, then
+ * the same scans for the log and powers of the luminance table.
+ */
+void SummedAreaTable::createLum(float* rgb, const uint width, const uint height, const uint nc)
+{
+    create(rgb, width, height, nc, 0, 0.0);
+}
+
+void SummedAreaTable::createLumCubeFace(const float* rgb, const uint size, const uint nc, const CubemapNormalizer& normalizer, const double weightAccum)
+{
+    create(rgb, size, size, nc, &normalizer, weightAccum);
+}
+
+void SummedAreaTable::create(const float* rgb, const uint width, const uint height, const uint nc, const CubemapNormalizer* cubeNormalizer, const double environmentWeight)
+{
+    assert(nc > 2);
+
+    _width = width;
+    _height = height;
+
+    const uint imgSize = width * height;
+
+    memset(&_zero, 0, sizeof(_zero));
+    _texels.clear();
+    _texels.resize(imgSize, _zero);
 
+    std::vector<SatRowStats> stats(height);
+    tbb::parallel_for(tbb::blocked_range<uint>(0, height), SatWeightWorker(rgb, width, height, nc, cubeNormalizer, &_texels[0], &stats[0]));
+
+    _minLum = DBL_MAX;
+    _maxLum = DBL_MIN;
+    _minPonderedLum = DBL_MAX;
+    _maxPonderedLum = DBL_MIN;
+    _minR = DBL_MAX;
+    _maxR = DBL_MIN;
+    _minG = DBL_MAX;
+    _maxG = DBL_MIN;
+    _minB = DBL_MAX;
+    _maxB = DBL_MIN;
+    _sum = 0.0;
+
+    double weightAccum = 0.0;
+    for (uint y = 0; y < height; ++y) {
+        const SatRowStats& row = stats[y];
+        _minLum = std::min(row._minLum, _minLum);
+        _maxLum = std::max(row._maxLum, _maxLum);
+        _minPonderedLum = std::min(row._minPonderedLum, _minPonderedLum);
+        _maxPonderedLum = std::max(row._maxPonderedLum, _maxPonderedLum);
+        _minR = std::min(row._minR, _minR);
+        _maxR = std::max(row._maxR, _maxR);
+        _minG = std::min(row._minG, _minG);
+        _maxG = std::max(row._maxG, _maxG);
+        _minB = std::min(row._minB, _minB);
+        _maxB = std::max(row._maxB, _maxB);
+        weightAccum += row._weightAccum;
+        _sum += row._sum;
+    }
+
+    // the faces of a cubemap are normalized by the weight of the six faces
+    if (environmentWeight > 0.0)
+        weightAccum = environmentWeight;
+
+    // store for later use.
+    _weightAccum = weightAccum;
+
+    // normalize in order our image Accumulation exactly match 4 PI.
+    const double normalizer = (4.0 * PI) / weightAccum;
+
+    _sum *= normalizer;
+    _minPonderedLum *= normalizer;
+    _maxPonderedLum *= normalizer;
+
+    // a constant channel is only shifted
+    _rangePonderedLum = _maxPonderedLum > _minPonderedLum ? _maxPonderedLum -_minPonderedLum : 1.0;
+    _rangeR = _maxR > _minR ? _maxR - _minR : 1.0;
+    _rangeG = _maxG > _minG ? _maxG - _minG : 1.0;
+    _rangeB = _maxB > _minB ? _maxB - _minB : 1.0;
+
+    // columns are scanned by blocks of a few cache lines
+    const uint columnGrain = 64;
+
+    // https://en.wikipedia.org/wiki/Summed_area_table
+    tbb::parallel_for(tbb::blocked_range<uint>(0, height),
+                      SatScanRowWorker(width, &_texels[0], normalizer,
+                                       _minPonderedLum, _rangePonderedLum,
+                                       _minR, _rangeR, _minG, _rangeG, _minB, _rangeB));
+    tbb::parallel_for(tbb::blocked_range<uint>(0, width, columnGrain), SatScanColumnWorker(width, height, &_texels[0], false));
+
+    tbb::parallel_for(tbb::blocked_range<uint>(0, height), SatMomentRowWorker(width, &_texels[0]));
+    tbb::parallel_for(tbb::blocked_range<uint>(0, width, columnGrain), SatScanColumnWorker(width, height, &_texels[0], true));
+}
+
+void SummedAreaTable::sumColors(const int x, const int y, const int w, const int h, double& lum, double& r, double& g, double& b) const
+{
+    SatTexel sums;
+    sumAll(x-1,     y-1,
+           x+(w-1), y-1,
+           x+(w-1), y+(h-1),
+           x-1,     y+(h-1), sums);
+
+    // each texel was (v - min) / range * 0.5
+    const double count = static_cast<double>(w) * h;
+    lum = sums._sum * 2.0 * _rangePonderedLum + count * _minPonderedLum;
+    r = sums._r * 2.0 * _rangeR + count * _minR;
+    g = sums._g * 2.0 * _rangeG + count * _minG;
+    b = sums._b * 2.0 * _rangeB + count * _minB;
 }
@@ -36,51 +36,40 @@ double SatRegion::getCornerDeviation() const
     return 0.5 * sqrt(f00fav + f10fav + f01fav + f11fav);
 }
 
-void SatRegion::create(const int x, const int y, const uint w, const uint h, const SummedAreaTable* sat)
+double SatRegion::sumLeft(const int w) const
 {
-    _x = x; _y = y; _w = w; _h = h; _sat = sat;
-
-    _sum = _sat->sum(x,       y,
-                     x+(w-1), y,
-                     x+(w-1), y+(h-1),
-                     x,       y+(h-1));
-
-    _r = _sat->sumR(x,       y,
-                    x+(w-1), y,
-                    x+(w-1), y+(h-1),
-                    x,       y+(h-1));
-
-    _g = _sat->sumG(x,       y,
-                    x+(w-1), y,
-                    x+(w-1), y+(h-1),
-                    x,       y+(h-1));
-
-    _b = _sat->sumB(x,       y,
-                    x+(w-1), y,
-                    x+(w-1), y+(h-1),
-                    x,       y+(h-1));
-
-
-    _sum2 = _sat->sum2(x,       y,
-                       x+(w-1), y,
-                       x+(w-1), y+(h-1),
-                       x,       y+(h-1));
-
-    _sum3 = _sat->sum3(x,       y,
-                       x+(w-1), y,
-                       x+(w-1), y+(h-1),
-                       x,       y+(h-1));
-
-    _sum4 = _sat->sum4(x,       y,
-                       x+(w-1), y,
-                       x+(w-1), y+(h-1),
-                       x,       y+(h-1));
-
-    _sum5 = _sat->sum5(x,       y,
-                       x+(w-1), y,
-                       x+(w-1), y+(h-1),
-                       x,       y+(h-1));
+    return _sat->sum(_x,       _y,
+                     _x+(w-1), _y,
+                     _x+(w-1), _y+(_h-1),
+                     _x,       _y+(_h-1));
+}
 
+double SatRegion::sumTop(const int h) const
+{
+    return _sat->sum(_x,        _y,
+                     _x+(_w-1), _y,
+                     _x+(_w-1), _y+(h-1),
+                     _x,        _y+(h-1));
+}
 
+void SatRegion::create(const int x, const int y, const uint w, const uint h, const SummedAreaTable* sat)
+{
+    _x = x; _y = y; _w = w; _h = h; _sat = sat;
 
+    SatTexel sums;
+    _sat->sumAll(x,       y,
+                 x+(w-1), y,
+                 x+(w-1), y+(h-1),
+                 x,       y+(h-1), sums);
+
+    _sum = sums._sum;
+    _sum1 = sums._sum1;
+    _sum2 = sums._sum2;
+    _sum3 = sums._sum3;
+    _sum4 = sums._sum4;
+    _sum5 = sums._sum5;
+
+    _r = sums._r;
+    _g = sums._g;
+    _b = sums._b;
 }
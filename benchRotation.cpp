@@ -0,0 +1,103 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "Math"
+
+// times the rotation of the light samples of the prefilter, with sin / cos
+// computed for every sample x rotation x texel like before RotationTable,
+// and with the table and one sin / cos of the offset per texel
+
+static double getTime()
+{
+    struct timeval tv;
+    gettimeofday( &tv, 0 );
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static int usage(const std::string& name)
+{
+    std::cerr << "Usage: " << name << " [-t texels] [-n nbsamples] [-r numRotations]" << std::endl;
+    return 1;
+}
+
+static inline Vec3f rotate(float c, float s, const Vec3f& l )
+{
+    return Vec3f( l[0] * c + l[1] * s, -l[0] * s + l[1] * c, l[2] );
+}
+
+int main(int argc, char *argv[])
+{
+    uint numTexels = 4096;
+    uint samples = 1024;
+    uint numRotations = 18;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:r:")) != -1)
+        switch (c)
+        {
+        case 't': numTexels = atoi(optarg);       break;
+        case 'n': samples = atoi(optarg);       break;
+        case 'r': numRotations = atoi(optarg);       break;
+
+        default: return usage(argv[0]);
+        }
+
+    if ( !numTexels || !samples || !numRotations )
+        return usage(argv[0]);
+
+    GGXSampleSet sampleSet( samples, 0.5f, 256 );
+    RotationTable rotations( numRotations );
+    float rad = rotations.getRadian();
+
+    // offsets of the texels like the prefilter computes them from the normal
+    std::vector<float> offsets( numTexels );
+    for ( uint t = 0; t < numTexels; t++ ) {
+        float gi = float( t % 512 );
+        offsets[t] = rad * ( cos( fmod( gi * 0.5f, 2.0f*PI ) ) * 0.5f + 0.5f );
+    }
+
+    Vec3f sumTrig( 0, 0, 0 ), sumTable( 0, 0, 0 );
+
+    double start = getTime();
+    for ( uint t = 0; t < numTexels; t++ ) {
+        float offset = offsets[t];
+        for ( uint i = 0; i < samples; i++ ) {
+            const Vec4f& L = sampleSet.getSample( i );
+            const Vec3f LDir( L[0], L[1], L[2] );
+            for ( uint r = 0; r < numRotations; r++ ) {
+                float angle = offset + r * rad;
+                sumTrig += rotate( cos( angle ), sin( angle ), LDir );
+            }
+        }
+    }
+    double trigTime = getTime() - start;
+
+    start = getTime();
+    for ( uint t = 0; t < numTexels; t++ ) {
+        float cosOffset = cos( offsets[t] );
+        float sinOffset = sin( offsets[t] );
+        for ( uint i = 0; i < samples; i++ ) {
+            const Vec4f& L = sampleSet.getSample( i );
+            const Vec3f LDir( L[0], L[1], L[2] );
+            for ( uint r = 0; r < numRotations; r++ ) {
+                float cr, sr;
+                rotations.getRotation( r, cosOffset, sinOffset, cr, sr );
+                sumTable += rotate( cr, sr, LDir );
+            }
+        }
+    }
+    double tableTime = getTime() - start;
+
+    double count = double( numTexels ) * samples * numRotations;
+    std::cout << numTexels << " texels x " << samples << " samples x " << numRotations << " rotations" << std::endl;
+    std::cout << "sin / cos per rotation " << trigTime << " s, " << trigTime * 1e9 / count << " ns per rotation" << std::endl;
+    std::cout << "rotation table " << tableTime << " s, " << tableTime * 1e9 / count << " ns per rotation" << std::endl;
+    std::cout << "speedup " << trigTime / tableTime << std::endl;
+    // the sums keep the loops alive and show the two paths agree
+    std::cout << "sum difference " << ( sumTrig - sumTable ).length() / count << " per rotation" << std::endl;
+
+    return 0;
+}
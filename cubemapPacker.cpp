@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/filter.h>
@@ -16,37 +17,49 @@
 #include "Math"
 #include "Cubemap"
 #include "Color"
+#include "Planar"
+#include "PackWriter"
+
+#include <tbb/parallel_for.h>
+#include <tbb/task_group.h>
 
 OIIO_NAMESPACE_USING
 
 
 bool writeByChannel = false;
+bool compressOutput = false;
+int compressionLevel = 9;
 
 struct CubemapRGBA8 {
 
     int _size;
     uint8_t* _images[6];
 
+    CubemapRGBA8(): _size(0) {}
+
     void init(int size) {
         _size = size;
         for ( int i = 0; i<6; i++)
-            _images[i] = new uint8_t[size*size*4];
+            _images[i] = new uint8_t[size*size*4]();
     }
 
-    void pack( FILE* output) {
+    void release() {
+        for ( int i = 0; _size && i<6; i++)
+            delete [] _images[i];
+        _size = 0;
+    }
+
+    void pack( PackWriter& output) {
 
         if (writeByChannel) {
             // write by channel
+            std::vector<uint8_t> planes;
             for ( int i = 0; i < 6; i++ )
-                for ( int c = 0; c < 4; c++ )
-                    for ( int b = 0; b < _size*_size; b++ ) {
-                        uint8_t* p = &(_images[i][b*4]);
-                        fwrite( &p[c], 1, 1 , output );
-                    }
+                writePlanar( output, _images[i], 4, _size*_size, planes );
         } else {
 
             for ( int i = 0; i < 6; i++ )
-                fwrite( _images[i], _size*_size*4, 1 , output );
+                output.write( _images[i], _size*_size*4 );
         }
 
     }
@@ -59,25 +72,30 @@ struct CubemapFloat {
     int _size;
     float* _images[6];
 
+    CubemapFloat(): _size(0) {}
+
     void init(int size) {
         _size = size;
         for ( int i = 0; i<6; i++)
-            _images[i] = new float[size*size*3];
+            _images[i] = new float[size*size*3]();
     }
 
-    void pack( FILE* output) {
+    void release() {
+        for ( int i = 0; _size && i<6; i++)
+            delete [] _images[i];
+        _size = 0;
+    }
+
+    void pack( PackWriter& output) {
 
         if (writeByChannel) {
 
+            std::vector<float> planes;
             for ( int i = 0; i < 6; i++ )
-                for ( int c = 0; c < 3; c++ )
-                    for ( int b = 0; b < _size*_size; b++ ) {
-                        float* p = &(_images[i][b*3]);
-                        fwrite( &p[c], 4, 1 , output );
-                    }
+                writePlanar( output, _images[i], 3, _size*_size, planes );
         } else {
             for ( int i = 0; i < 6; i++ ) {
-                fwrite( _images[i], _size*_size*4*3, 1 , output );
+                output.write( _images[i], _size*_size*4*3 );
             }
         }
     }
@@ -85,144 +103,135 @@ struct CubemapFloat {
 };
 
 
+// encodings of one cubemap file, only the requested ones are allocated
+struct PackedLevel {
 
-class Packer
-{
+    int _size;
+    std::string _file;
+    bool _loaded;
 
-public:
+    CubemapRGBA8 _rgbm;
+    CubemapRGBA8 _rgbe;
+    CubemapRGBA8 _luv;
+    CubemapFloat _float;
 
-    std::map<int, CubemapRGBA8 > _cubemapsRGBM;
-    std::map<int, CubemapRGBA8 > _cubemapsRGBE;
-    std::map<int, CubemapRGBA8 > _cubemapsLUV;
-    std::map<int, CubemapFloat > _cubemapsFloat;
-    std::vector<int> _keys;
-    std::string _input;
-    std::string _outputDirectory;
+    PackedLevel( int size, const std::string& file ): _size(size), _file(file), _loaded(false) {}
+};
 
-    bool _rgbm, _rgbe, _float, _luv;
 
-    int _maxLevel;
+// encodes a face straight from the cubemap buffer
+struct EncodeFaceWorker {
 
-    Packer(const std::string& input, int level, const std::string& outputDirectory ) {
-        _input = input;
-        _maxLevel = level;
-        _outputDirectory = outputDirectory;
+    const Cubemap::MipLevel& _images;
+    PackedLevel& _level;
 
-        _rgbe = _float = _rgbm = _luv = false;
-    }
-    void setRGBE( bool state ) { _rgbe = state; }
-    void setRGBM( bool state ) { _rgbm = state; }
-    void setFloat( bool state ) { _float = state; }
-    void setLUV( bool state ) { _luv = state; }
-    bool processCubemap( uint size, const std::string& name ) {
+    EncodeFaceWorker( const Cubemap::MipLevel& images, PackedLevel& level ): _images(images), _level(level) {}
 
-        Cubemap cm;
-        bool loaded = cm.load(name);
+    void operator()(const tbb::blocked_range<int>& r) const {
 
-        if (!size)
-            size = cm.getSize();
+        uint spp = _images.getSamplePerPixel();
+        size_t count = size_t(_level._size) * _level._size;
 
-        _keys.push_back( size );
+        for ( int face = r.begin(); face != r.end(); ++face ) {
 
-        _cubemapsRGBE[size].init(size);
-        _cubemapsRGBM[size].init(size);
-        _cubemapsLUV[size].init(size);
-        _cubemapsFloat[size].init(size);
+            const float* in = _images.imageFace( face );
 
-        if ( !loaded ) {
-            return false;
-        }
+            // the encoders take rgb pixels, it could be greyscale or have alpha
+            std::vector<float> rgb;
+            if ( spp != 3 ) {
+                rgb.resize( count * 3 );
+                for ( size_t i = 0; i < count; i++ ) {
+                    const float* pixel = in + i * spp;
+                    rgb[i*3] = pixel[0];
+                    rgb[i*3+1] = spp < 3 ? pixel[0] : pixel[1];
+                    rgb[i*3+2] = spp < 3 ? pixel[0] : pixel[2];
+                }
+                in = &rgb[0];
+            }
 
+            if ( _level._rgbe._size )
+                encodeRGBE( in, _level._rgbe._images[face], count );
 
-        uint cubemapSize = cm.getSize();
-        for ( int i = 0 ; i < 6; i++ ) {
+            if ( _level._rgbm._size )
+                encodeRGBM( in, _level._rgbm._images[face], count );
 
-            ImageSpec specIn(cubemapSize, cubemapSize, cm.getSamplePerPixel(), TypeDesc::FLOAT);
-            ImageBuf src(specIn, cm.getImages().imageFace(i));
+            if ( _level._luv._size )
+                encodeLUV( in, _level._luv._images[face], count );
 
-            //std::cout << "processing " << str << " size " << specIn.width << "x" << specIn.height << std::endl;
+            if ( _level._float._size )
+                memcpy( _level._float._images[face], in, count * 3 * sizeof(float) );
+        }
+    }
+};
 
-            ImageSpec specOutRGBE(specIn.width, specIn.height, 4, TypeDesc::UINT8 );
-            specOutRGBE.attribute("oiio:UnassociatedAlpha", 1);
 
-            ImageSpec specOutRGBM(specIn.width, specIn.height, 4, TypeDesc::UINT8 );
-            specOutRGBM.attribute("oiio:UnassociatedAlpha", 1);
+// appends an encoded level to the file of its encoding and frees it
+template<class T>
+struct PackEncodingTask {
 
-            ImageSpec specOutLUV(specIn.width, specIn.height, 4, TypeDesc::UINT8 );
-            specOutLUV.attribute("oiio:UnassociatedAlpha", 1);
+    T& _images;
+    PackWriter& _output;
 
-            ImageBuf dstRGBE(specOutRGBE, _cubemapsRGBE[size]._images[i]);
-            ImageBuf dstRGBM(specOutRGBM, _cubemapsRGBM[size]._images[i]);
-            ImageBuf dstLUV(specOutLUV, _cubemapsLUV[size]._images[i]);
+    PackEncodingTask( T& images, PackWriter& output ): _images(images), _output(output) {}
 
+    void operator()() const {
+        _images.pack( _output );
+        _images.release();
+    }
+};
 
-            ImageSpec specOutFloat(specIn.width, specIn.height, 3, TypeDesc::FLOAT );
-            ImageBuf dstFloat("/tmp/test_super_debug.tif", specOutFloat, _cubemapsFloat[size]._images[i]);
 
+class Packer
+{
 
-            int width = specIn.width,
-                height = specIn.height;
+public:
 
-            ImageBuf::Iterator<float, float> iteratorSrc(src, 0, width, 0, height);
+    std::vector<PackedLevel> _levels;
+    std::string _input;
+    std::string _outputDirectory;
 
-            ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstRGBE(dstRGBE, 0, width, 0, height);
-            ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstRGBM(dstRGBM, 0, width, 0, height);
-            ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstLUV(dstLUV, 0, width, 0, height);
-            ImageBuf::Iterator<float, float> iteratorDstFloat(dstFloat, 0, width, 0, height);
+    bool _rgbm, _rgbe, _float, _luv;
 
-            float result[3];
-            float inTmp[3];
-            float* in;
-            float biggest = 0.0;
-            for (;iteratorDstRGBE.valid();
-                 iteratorSrc++,
-                     iteratorDstRGBE++,
-                     iteratorDstRGBM++,
-                     iteratorDstLUV++,
-                     iteratorDstFloat++) {
+    int _maxLevel;
 
-                iteratorSrc.pos( iteratorDstRGBE.x(), iteratorDstRGBE.y(), iteratorDstRGBE.z());
+    Packer(const std::string& input, int level, const std::string& outputDirectory ) {
+        _input = input;
+        _maxLevel = level;
+        _outputDirectory = outputDirectory;
 
-                float* inRaw = (float*)iteratorSrc.rawptr();
+        _rgbe = _float = _rgbm = _luv = false;
+    }
+    void setRGBE( bool state ) { _rgbe = state; }
+    void setRGBM( bool state ) { _rgbm = state; }
+    void setFloat( bool state ) { _float = state; }
+    void setLUV( bool state ) { _luv = state; }
 
-                // we assume to have at least 3 channel in inputs, but it could be greyscale
-                if ( specIn.nchannels < 3 ) {
-                    inTmp[0] = inRaw[0];
-                    inTmp[1] = inRaw[0];
-                    inTmp[2] = inRaw[0];
-                    in = inTmp;
-                } else {
-                    in = inRaw;
-                }
+    bool processCubemap( PackedLevel& level ) const {
 
-                if ( _rgbe ) {
-                    uint8_t* outRGBE = (uint8_t*)iteratorDstRGBE.rawptr();
-                    encodeRGBE(in, outRGBE );
-                }
+        Cubemap cm;
+        bool loaded = cm.load( level._file );
 
-                if ( _rgbm ) {
-                    uint8_t* outRGBM = (uint8_t*)iteratorDstRGBM.rawptr();
-                    encodeRGBM(in, outRGBM );
-                }
+        if ( !level._size && loaded )
+            level._size = cm.getSize();
 
-                if ( _luv ) {
-                    uint8_t* outLUV = (uint8_t*)iteratorDstLUV.rawptr();
-                    encodeLUV(in, outLUV );
-                }
+        if ( _rgbe )
+            level._rgbe.init( level._size );
+        if ( _rgbm )
+            level._rgbm.init( level._size );
+        if ( _luv )
+            level._luv.init( level._size );
+        if ( _float )
+            level._float.init( level._size );
 
-                if ( _float ) {
-                    float* outFloat = (float*)iteratorDstFloat.rawptr();
-                    outFloat[0] = in[0];
-                    outFloat[1] = in[1];
-                    outFloat[2] = in[2];
-                }
+        if ( !loaded || cm.getSize() != level._size )
+            return false;
 
-            }
-        }
+        tbb::parallel_for( tbb::blocked_range<int>( 0, 6, 1 ), EncodeFaceWorker( cm.getImages(), level ) );
         return true;
     }
 
-    void pack() {
+    // false when an output could not be written
+    bool pack() {
 
         char str[256];
 
@@ -237,58 +246,71 @@ public:
                 int strSize = snprintf( str, 255, _input.c_str(), level );
                 str[strSize+1] = 0;
 
-                bool result = processCubemap( size, str );
-                if (!result)
-                    std::cout << "can't read cubemap " << str << " for size " << size << ", skipped" << std::endl;
+                _levels.push_back( PackedLevel( size, str ) );
             }
 
         } else {
-
-            // when using pattern options
-            bool result = processCubemap( 0, _input );
-            if (!result)
-                std::cout << "error can't read file " << _input << std::endl;
-
-        }
-
-        if ( _rgbe ) {
-            FILE* outputRGBE = fopen( (_outputDirectory + "_rgbe.bin").c_str(), "wb");
-            for ( int i = 0; i < _keys.size(); i++ ) {
-                int key = _keys[i];
-                _cubemapsRGBE[key].pack(outputRGBE);
-            }
+            _levels.push_back( PackedLevel( 0, _input ) );
         }
 
-        if ( _rgbm ) {
-            FILE* outputRGBM = fopen( (_outputDirectory + "_rgbm.bin").c_str(), "wb");
-            for ( int i = 0; i < _keys.size(); i++ ) {
-                int key = _keys[i];
-                _cubemapsRGBM[key].pack(outputRGBM);
+        PackWriter outputRGBE, outputRGBM, outputLUV, outputFloat;
+        if ( _rgbe )
+            outputRGBE.open( _outputDirectory + "_rgbe.bin", compressOutput, compressionLevel );
+        if ( _rgbm )
+            outputRGBM.open( _outputDirectory + "_rgbm.bin", compressOutput, compressionLevel );
+        if ( _luv )
+            outputLUV.open( _outputDirectory + "_luv.bin", compressOutput, compressionLevel );
+        if ( _float )
+            outputFloat.open( _outputDirectory + "_float.bin", compressOutput, compressionLevel );
+
+        // levels are encoded in the order of the files, faces in parallel.
+        // Each encoding of a level is then written by its own task while
+        // the next level is loaded and encoded, PackWriter compresses the
+        // blocks in the background
+        tbb::task_group writers;
+        for ( uint i = 0; i < _levels.size(); i++ ) {
+            PackedLevel& level = _levels[i];
+            level._loaded = processCubemap( level );
+
+            if ( !level._loaded ) {
+                if ( _maxLevel > 0 )
+                    std::cout << "can't read cubemap " << level._file << " for size " << level._size << ", skipped" << std::endl;
+                else
+                    std::cout << "error can't read file " << _input << std::endl;
             }
-        }
 
-        if ( _luv ) {
-            FILE* outputLUV = fopen( (_outputDirectory + "_luv.bin").c_str(), "wb");
-            for ( int i = 0; i < _keys.size(); i++ ) {
-                int key = _keys[i];
-                _cubemapsLUV[key].pack(outputLUV);
-            }
-        }
-
-        if ( _float ) {
-            FILE* outputFloat = fopen( (_outputDirectory + "_float.bin").c_str() , "wb");
-            for ( int i = 0; i < _keys.size(); i++ ) {
-                int key = _keys[i];
-                _cubemapsFloat[key].pack(outputFloat);
-            }
+            // a file gets the levels one after the other
+            writers.wait();
+
+            if ( _rgbe )
+                writers.run( PackEncodingTask<CubemapRGBA8>( level._rgbe, outputRGBE ) );
+            if ( _rgbm )
+                writers.run( PackEncodingTask<CubemapRGBA8>( level._rgbm, outputRGBM ) );
+            if ( _luv )
+                writers.run( PackEncodingTask<CubemapRGBA8>( level._luv, outputLUV ) );
+            if ( _float )
+                writers.run( PackEncodingTask<CubemapFloat>( level._float, outputFloat ) );
         }
+        writers.wait();
+
+        // close also reports the failures of open and write
+        bool result = true;
+        if ( _rgbe )
+            result = outputRGBE.close() && result;
+        if ( _rgbm )
+            result = outputRGBM.close() && result;
+        if ( _luv )
+            result = outputLUV.close() && result;
+        if ( _float )
+            result = outputFloat.close() && result;
+        return result;
     }
 
 };
 
 static int usage(const std::string& name)
 {
-    std::cerr << "Usage: " << name << " [-c write by channel] [-e encodingFlags] [-p toogle pattern] [-n nb level] input.tif outputdirectory" << std::endl;
+    std::cerr << "Usage: " << name << " [-c write by channel] [-z gzip outputs] [-l gzip level] [-e encodingFlags] [-p toogle pattern] [-n nb level] input.tif outputdirectory" << std::endl;
     std::cerr << "eg: " << name << " -e luv:rgbm:rgbe:float -p -n 5 input_%d.tif /tmp/test/" << std::endl;
     std::cerr << "eg: " << name << "input.tif /tmp/test/" << std::endl;
     return 1;
@@ -302,17 +324,23 @@ int main(int argc, char** argv) {
     writeByChannel = false;
     std::string colorencoding = "luv:rgbm:rgbe:float";
 
-    while ((c = getopt(argc, argv, "ce:pn:")) != -1)
+    while ((c = getopt(argc, argv, "czl:e:pn:")) != -1)
         switch (c)
         {
         case 'e': colorencoding = std::string(optarg);     break;
         case 'c': writeByChannel = true;     break;
+        case 'z': compressOutput = true;     break;
+        case 'l': compressionLevel = atoi(optarg);     break;
         case 'p': pattern = true;     break;
         case 'n': nb = atoi(optarg);  break;
 
         default: return usage(argv[0]);
         }
 
+    if ( compressionLevel < 0 || compressionLevel > 9 ) {
+        std::cerr << "gzip level should be between 0 and 9" << std::endl;
+        return usage( argv[0] );
+    }
 
     std::string input, output;
     if ( optind < argc-1 ) {
@@ -330,7 +358,8 @@ int main(int argc, char** argv) {
             packer.setRGBM( true );
         if ( colorencoding.find("float" ) != std::string::npos )
             packer.setFloat( true );
-        packer.pack();
+        if ( !packer.pack() )
+            return 1;
 
     } else {
         return usage( argv[0] );
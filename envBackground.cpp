@@ -7,7 +7,8 @@
 
 static int usage(const std::string& name)
 {
-    std::cerr << "Usage: " << name << " [-s size] [-n nbsamples] [-r numRotations] [-b blur angle ] [-f toggle fixup edge ] in.tif out.tif" << std::endl;
+    std::cerr << "Usage: " << name << " [-s size] [-n nbsamples] [-r numRotations] [-b blur angle ] [-f toggle fixup edge ] [-F fast blur using mipmaps] in.tif out.tif" << std::endl;
+    std::cerr << "fast blur uses 16 samples and 4 rotations by default" << std::endl;
     return 1;
 }
 
@@ -16,12 +17,13 @@ int main(int argc, char *argv[])
 
     int size = 0;
     int c;
-    int samples = 128;
+    int samples = 0;
     int fixup = 0;
-    int numRotations = 18;
+    int numRotations = 0;
     float blur = 0.1;
+    bool fast = false;
 
-    while ((c = getopt(argc, argv, "s:n:r:b:f")) != -1)
+    while ((c = getopt(argc, argv, "s:n:r:b:fF")) != -1)
         switch (c)
         {
         case 's': size = atoi(optarg);       break;
@@ -29,10 +31,17 @@ int main(int argc, char *argv[])
         case 'r': numRotations = atoi(optarg);  break;
         case 'b': blur = atof(optarg);  break;
         case 'f': fixup = 1;  break;
+        case 'F': fast = true;  break;
 
         default: return usage(argv[0]);
         }
 
+    // fetching from the mipmaps needs much less samples
+    if ( !samples )
+        samples = fast ? 16 : 128;
+    if ( !numRotations )
+        numRotations = fast ? 4 : 18;
+
     std::string input, output;
     if ( optind < argc-1 ) {
 
@@ -42,7 +51,7 @@ int main(int argc, char *argv[])
 
         Cubemap image;
         image.load(input);
-        image.computeBackground( output, size, samples, numRotations, blur, fixup );
+        image.computeBackground( output, size, samples, numRotations, blur, fixup, fast );
 
     } else {
         return usage( argv[0] );
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Cubemap"
+
+static int usage(const std::string& name)
+{
+    std::cerr << "Usage: " << name << " [-m build mipmap] in.tif out.cbm" << std::endl;
+    std::cerr << "in.tif can be a mipmap pattern like /tmp/specular_%d.tif" << std::endl;
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+
+    bool mipmap = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "m")) != -1)
+        switch (c)
+        {
+        case 'm': mipmap = true;  break;
+
+        default: return usage(argv[0]);
+        }
+
+    std::string input, output;
+    if ( optind < argc-1 ) {
+
+        input = std::string( argv[optind] );
+        output = std::string( argv[optind+1] );
+
+        Cubemap image;
+
+        // check if we can load mipmap
+        bool loaded;
+        if ( input.find("%") != std::string::npos )
+            loaded = image.loadMipMap(input);
+        else
+            loaded = image.load(input);
+
+        if ( !loaded ) {
+            std::cout << "error can't read file " << input << std::endl;
+            return 1;
+        }
+
+        if ( mipmap && image._levels.size() == 1 )
+            image.buildMipMap();
+
+        if ( !image.writeCache( output ) )
+            return 1;
+
+    } else {
+        return usage( argv[0] );
+    }
+
+
+    return 0;
+}
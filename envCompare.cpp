@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+
+#include "Cubemap"
+
+static int usage(const char *exe)
+{
+    std::cerr << "Usage: " << exe << " reference.tif test.tif" << std::endl;
+    std::cerr << "print the error of test.tif against reference.tif, eg to compare envBackground -F with the default" << std::endl;
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if ( argc < 3 )
+        return usage(argv[0]);
+
+    Cubemap reference, test;
+    if ( !reference.load( argv[1] ) ) {
+        std::cout << "error can't read file " << argv[1] << std::endl;
+        return 1;
+    }
+    if ( !test.load( argv[2] ) ) {
+        std::cout << "error can't read file " << argv[2] << std::endl;
+        return 1;
+    }
+
+    if ( reference.getSize() != test.getSize() ) {
+        std::cout << "error cubemaps have different sizes " << reference.getSize() << " and " << test.getSize() << std::endl;
+        return 1;
+    }
+
+    uint size = reference.getSize();
+    uint refSamplePerPixel = reference.getSamplePerPixel();
+    uint testSamplePerPixel = test.getSamplePerPixel();
+
+    double squareError[3] = { 0.0, 0.0, 0.0 };
+    double maxError = 0.0;
+    double peak = 0.0;
+
+    for ( uint face = 0; face < 6; face++ ) {
+        const float* ref = reference.getImages().imageFace( face );
+        const float* tst = test.getImages().imageFace( face );
+
+        for ( uint i = 0; i < size*size; i++ ) {
+            for ( uint c = 0; c < 3; c++ ) {
+                double r = ref[ i * refSamplePerPixel + c ];
+                double t = tst[ i * testSamplePerPixel + c ];
+                double diff = t - r;
+                squareError[c] += diff * diff;
+                maxError = std::max( maxError, fabs( diff ) );
+                peak = std::max( peak, r );
+            }
+        }
+    }
+
+    // hdr images, the peak is the max value of the reference
+    double nbTexels = 6.0 * size * size;
+    double mse = ( squareError[0] + squareError[1] + squareError[2] ) / ( 3.0 * nbTexels );
+
+    std::cout << "mse r " << squareError[0] / nbTexels << " g " << squareError[1] / nbTexels << " b " << squareError[2] / nbTexels << std::endl;
+    std::cout << "mse " << mse << " max error " << maxError << " peak " << peak << std::endl;
+    if ( mse > 0.0 )
+        std::cout << "psnr " << 10.0 * log10( peak * peak / mse ) << " dB" << std::endl;
+    else
+        std::cout << "psnr inf" << std::endl;
+
+    return 0;
+}
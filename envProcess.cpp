@@ -0,0 +1,199 @@
+#include <iostream>
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+
+#include <tbb/task_group.h>
+#include <tbb/tick_count.h>
+
+#include "Cubemap"
+#include "BRDF"
+
+// Runs in one process the stages that process_environment.py executes one
+// by one: the cubemap and its mip chain are loaded once and shared by the
+// prefilter, background and irradiance stages which run concurrently with
+// the brdf lut.
+
+static int usage(const std::string& name)
+{
+    std::cerr << "Usage: " << name << " [-s specular size] [-e stopSize] [-n nbsamples] [-r numRotations] [-f fixup flag] [-b background size] [-B background blur] [-N background nbsamples] [-R background numRotations] [-x background fixup flag] [-F fast background] [-i irradiance size] [-l brdf lut size] [-S brdf nbsamples] in.tif outputPrefix" << std::endl;
+    std::cerr << "in.tif can be a mipmap pattern like /tmp/specular_%d.tif, else the mip chain is built from in.tif" << std::endl;
+    std::cerr << "writes outputPrefix{prefilter_%d.tif,background.tif,irradiance.tif,brdf_ue4.bin}" << std::endl;
+    std::cerr << "rotations and samples default to the ones of envPrefilter, envBackground and envBRDF" << std::endl;
+    return 1;
+}
+
+// the background is computed from the mip level of its size so the
+// samples cover the same area than with envBackground on that level.
+// The levels are shared with cubemap, not copied
+static void extractMipChain( const Cubemap& cubemap, int size, Cubemap& result )
+{
+    uint level = 0;
+    while ( level + 1 < cubemap._levels.size() && cubemap.getImages( level ).getSize() > uint(size) )
+        level++;
+
+    result._levels.resize( cubemap._levels.size() - level );
+    for ( uint i = 0; i < result._levels.size(); i++ )
+        result._levels[i].share( cubemap._levels[level + i] );
+}
+
+struct PrefilterStage {
+    const Cubemap& _cubemap;
+    std::string _output;
+    int _size, _endSize, _samples, _numRotations, _fixup;
+
+    PrefilterStage( const Cubemap& cubemap, const std::string& output, int size, int endSize, int samples, int numRotations, int fixup ):
+        _cubemap(cubemap), _output(output), _size(size), _endSize(endSize), _samples(samples), _numRotations(numRotations), _fixup(fixup) {}
+
+    void operator()() const {
+        tbb::tick_count start = tbb::tick_count::now();
+        _cubemap.computePrefilteredEnvironmentUE4( _output, _size, _endSize, _samples, _numRotations, _fixup );
+        std::cout << "== " << ( tbb::tick_count::now() - start ).seconds() << " prefilter ==" << std::endl;
+    }
+};
+
+struct BackgroundStage {
+    const Cubemap& _cubemap;
+    std::string _output;
+    int _size, _samples, _numRotations, _fixup;
+    float _blur;
+    bool _fast;
+
+    BackgroundStage( const Cubemap& cubemap, const std::string& output, int size, int samples, int numRotations, float blur, int fixup, bool fast ):
+        _cubemap(cubemap), _output(output), _size(size), _samples(samples), _numRotations(numRotations), _fixup(fixup), _blur(blur), _fast(fast) {}
+
+    void operator()() const {
+        tbb::tick_count start = tbb::tick_count::now();
+        Cubemap source;
+        extractMipChain( _cubemap, _size, source );
+        source.computeBackground( _output, _size, _samples, _numRotations, _blur, _fixup, _fast );
+        std::cout << "== " << ( tbb::tick_count::now() - start ).seconds() << " background ==" << std::endl;
+    }
+};
+
+struct IrradianceStage {
+    const Cubemap& _cubemap;
+    std::string _output;
+    int _size;
+
+    IrradianceStage( const Cubemap& cubemap, const std::string& output, int size ):
+        _cubemap(cubemap), _output(output), _size(size) {}
+
+    void operator()() const {
+        tbb::tick_count start = tbb::tick_count::now();
+        // shFilterCubeMap prints the shCoef line used in the config
+        Cubemap* result = _cubemap.shFilterCubeMap( true, 0, _size );
+        result->write( _output );
+        delete result;
+        std::cout << "== " << ( tbb::tick_count::now() - start ).seconds() << " irradiance ==" << std::endl;
+    }
+};
+
+struct BRDFStage {
+    std::string _output;
+    int _size, _samples;
+
+    BRDFStage( const std::string& output, int size, int samples ): _output(output), _size(size), _samples(samples) {}
+
+    void operator()() const {
+        tbb::tick_count start = tbb::tick_count::now();
+        RougnessNoVLUT lut( _size, _samples );
+        lut.processRoughnessNoVLut( _output );
+        std::cout << "== " << ( tbb::tick_count::now() - start ).seconds() << " brdf lut ==" << std::endl;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+
+    int specularSize = 256;
+    int endSize = 8;
+    int samples = 1024;
+    int numRotations = 18;
+    int fixup = 0;
+    int backgroundSize = 256;
+    int backgroundSamples = 0;
+    int backgroundRotations = 0;
+    int backgroundFixup = 0;
+    float backgroundBlur = 0.1;
+    bool fast = false;
+    int irradianceSize = 32;
+    int brdfSize = 128;
+    int brdfSamples = 1024;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:e:n:r:fb:B:N:R:xFi:l:S:")) != -1)
+        switch (c)
+        {
+        case 's': specularSize = atoi(optarg);       break;
+        case 'e': endSize = atoi(optarg);  break;
+        case 'n': samples = atoi(optarg);  break;
+        case 'r': numRotations = atoi(optarg);  break;
+        case 'f': fixup = 1;  break;
+        case 'b': backgroundSize = atoi(optarg);  break;
+        case 'B': backgroundBlur = atof(optarg);  break;
+        case 'N': backgroundSamples = atoi(optarg);  break;
+        case 'R': backgroundRotations = atoi(optarg);  break;
+        case 'x': backgroundFixup = 1;  break;
+        case 'F': fast = true;  break;
+        case 'i': irradianceSize = atoi(optarg);  break;
+        case 'l': brdfSize = atoi(optarg);  break;
+        case 'S': brdfSamples = atoi(optarg);  break;
+
+        default: return usage(argv[0]);
+        }
+
+    // same defaults than envBackground
+    if ( !backgroundSamples )
+        backgroundSamples = fast ? 16 : 128;
+    if ( !backgroundRotations )
+        backgroundRotations = fast ? 4 : 18;
+
+    if ( optind >= argc-1 )
+        return usage( argv[0] );
+
+    std::string input = std::string( argv[optind] );
+    std::string output = std::string( argv[optind+1] );
+
+    tbb::tick_count start = tbb::tick_count::now();
+
+    // the cubemap and its mip chain are loaded once for all the stages
+    Cubemap cubemap;
+    if ( input.find("%") != std::string::npos ) {
+        if ( !cubemap.loadMipMap( input ) ) {
+            std::cout << "error can't read mipmap " << input << std::endl;
+            return 1;
+        }
+    } else {
+        if ( !cubemap.load( input ) ) {
+            std::cout << "error can't read file " << input << std::endl;
+            return 1;
+        }
+        // a .cbm cache already has its mip chain
+        if ( cubemap._levels.size() == 1 )
+            cubemap.buildMipMap();
+    }
+
+    // the stages sample the levels as a mip chain, a pattern can miss some
+    for ( uint i = 1; i < cubemap._levels.size(); i++ ) {
+        if ( cubemap.getImages( i ).getSize() != cubemap.getImages( 0 ).getSize() >> i ) {
+            std::cout << "error the levels of " << input << " are not a mip chain" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "== " << ( tbb::tick_count::now() - start ).seconds() << " load ==" << std::endl;
+
+    // stages only read the shared cubemap, each one uses parallel_for
+    // internally and tbb balances the work between them
+    tbb::task_group group;
+    group.run( PrefilterStage( cubemap, output + "prefilter", specularSize, endSize, samples, numRotations, fixup ) );
+    group.run( BackgroundStage( cubemap, output + "background.tif", backgroundSize, backgroundSamples, backgroundRotations, backgroundBlur, backgroundFixup, fast ) );
+    group.run( IrradianceStage( cubemap, output + "irradiance.tif", irradianceSize ) );
+    group.run( BRDFStage( output + "brdf_ue4.bin", brdfSize, brdfSamples ) );
+    group.wait();
+
+    std::cout << "processed in " << ( tbb::tick_count::now() - start ).seconds() << " seconds" << std::endl;
+
+    return 0;
+}
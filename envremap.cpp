@@ -25,6 +25,7 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 
 #include "gray.h"
 #include "sRGB.h"
@@ -36,6 +37,7 @@
 struct image
 {
     float *p;  // data
+    float **r; // row pointers, rows may not be contiguous when streaming
     int    h;  // height
     int    w;  // width
     int    c;  // sample count
@@ -63,6 +65,17 @@ struct pattern
 
 typedef struct pattern pattern;
 
+/* A sample location in the source, f < 0 when the sample is outside.       */
+
+struct location
+{
+    int   f;
+    float i;
+    float j;
+};
+
+typedef struct location location;
+
 /*----------------------------------------------------------------------------*/
 
 typedef void (*filter)(const image *, float, float, float *);
@@ -256,6 +269,17 @@ int TIFFWriteFloatScanline(TIFF *T, float *src, uint32 r)
 
 /*----------------------------------------------------------------------------*/
 
+/* Point the row table of an image to its contiguous pixel buffer.           */
+
+static void image_rows(image *img)
+{
+    int i;
+
+    if ((img->r = (float **) malloc(img->h * sizeof (float *))))
+        for (i = 0; i < img->h; i++)
+            img->r[i] = img->p + img->w * img->c * i;
+}
+
 /* Allocate and initialize n image structures, each with a floating point     */
 /* pixel buffer with width w, height h, and channel count c.                  */
 
@@ -281,6 +305,7 @@ static image *image_alloc(int n, int h, int w, int c, int b, int s)
             img[f].c = c;
             img[f].b = b;
             img[f].s = s;
+            image_rows(img + f);
         }
 
     return img;
@@ -336,6 +361,7 @@ static image *image_reader(const char *name, int n)
                     in[f].c = (int)     c;
                     in[f].b = (int)     b;
                     in[f].s = (int)     s;
+                    image_rows(in + f);
                 }
             }
         }
@@ -344,6 +370,31 @@ static image *image_reader(const char *name, int n)
     return in;
 }
 
+/* Set the fields of the current page of a TIFF file being written.         */
+
+static void image_fields(TIFF *T, const image *out)
+{
+    TIFFSetField(T, TIFFTAG_IMAGEWIDTH,      out->w);
+    TIFFSetField(T, TIFFTAG_IMAGELENGTH,     out->h);
+    TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, out->c);
+    TIFFSetField(T, TIFFTAG_BITSPERSAMPLE,   out->b);
+    TIFFSetField(T, TIFFTAG_SAMPLEFORMAT,    out->s);
+    TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_TOPLEFT);
+    //TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_BOTLEFT);
+    TIFFSetField(T, TIFFTAG_PLANARCONFIG,    PLANARCONFIG_CONTIG);
+
+    if (out->c == 1)
+    {
+        TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_MINISBLACK);
+        TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (grayicc), grayicc);
+    }
+    else
+    {
+        TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_RGB);
+        TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (sRGBicc), sRGBicc);
+    }
+}
+
 /* Write n pages to the named TIFF image file.                                */
 
 static void image_writer(const char *name, image *out, int n)
@@ -355,25 +406,7 @@ static void image_writer(const char *name, image *out, int n)
     {
         for (f = 0; f < n; ++f)
         {
-            TIFFSetField(T, TIFFTAG_IMAGEWIDTH,      out[f].w);
-            TIFFSetField(T, TIFFTAG_IMAGELENGTH,     out[f].h);
-            TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, out[f].c);
-            TIFFSetField(T, TIFFTAG_BITSPERSAMPLE,   out[f].b);
-            TIFFSetField(T, TIFFTAG_SAMPLEFORMAT,    out[f].s);
-            TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_TOPLEFT);
-            //TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_BOTLEFT);
-            TIFFSetField(T, TIFFTAG_PLANARCONFIG,    PLANARCONFIG_CONTIG);
-
-            if (out[f].c == 1)
-            {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_MINISBLACK);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (grayicc), grayicc);
-            }
-            else
-            {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_RGB);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (sRGBicc), sRGBicc);
-            }
+            image_fields(T, out + f);
 
             for (r = 0; r < out[f].h; ++r)
                 TIFFWriteFloatScanline(T, out[f].p + out[f].w * out[f].c * r, r);
@@ -511,13 +544,16 @@ static void filter_linear(const image *img, float i, float j, float *p)
     const float di = ii - i0;
     const float dj = jj - j0;
 
+    const float *r0 = img->r[i0];
+    const float *r1 = img->r[i1];
+
     int k;
 
     for (k = 0; k < img->c; k++)
-        p[k] += lerp(lerp(img->p[(img->w * i0 + j0) * img->c + k],
-                          img->p[(img->w * i0 + j1) * img->c + k], dj),
-                     lerp(img->p[(img->w * i1 + j0) * img->c + k],
-                          img->p[(img->w * i1 + j1) * img->c + k], dj), di);
+        p[k] += lerp(lerp(r0[j0 * img->c + k],
+                          r0[j1 * img->c + k], dj),
+                     lerp(r1[j0 * img->c + k],
+                          r1[j1 * img->c + k], dj), di);
 }
 
 /* Sample an image at row i column j using nearest neighbor.                  */
@@ -533,7 +569,7 @@ static void filter_nearest(const image *img, float i, float j, float *p)
     int k;
 
     for (k = 0; k < img->c; k++)
-        p[k] += img->p[(img->w * i0 + j0) * img->c + k];
+        p[k] += img->r[i0][j0 * img->c + k];
 }
 
 /*----------------------------------------------------------------------------*/
@@ -741,71 +777,6 @@ static int xfm(const float *rot, float *v)
     return 1;
 }
 
-void supersample(const image   *src,
-                 const image   *dst,
-                 const pattern *pat,
-                 const float   *rot,
-                 filter fil, to_img img, to_env env, int f, int i, int j)
-{
-    int    F;
-    float  I;
-    float  J;
-    int    k;
-    int    c = 0;
-    float *p = dst[f].p + dst[f].c * (dst[f].w * i + j);
-
-    /* For each sample of the supersampling pattern... */
-
-    for (k = 0; k < pat->n; k++)
-    {
-        const float ii = pat->p[k].i + i;
-        const float jj = pat->p[k].j + j;
-
-        /* Project and unproject giving the source location. Sample there. */
-
-        float v[3];
-
-        if (env( f, ii, jj, dst->h, dst->w, v) && xfm(rot, v) &&
-            img(&F, &I, &J, src->h, src->w, v))
-        {
-#if 1
-            fil(src + F, I, J, p);
-#else
-            p[0] = (v[0] + 1.0f) / 2.0f;
-            p[1] = (v[1] + 1.0f) / 2.0f;
-            p[2] = (v[2] + 1.0f) / 2.0f;
-#endif
-            c++;
-        }
-    }
-
-    /* Normalize the sample. */
-
-    for (k = 0; k < dst->c; k++)
-        p[k] /= c;
-}
-
-void process(const image   *src,
-             const image   *dst,
-             const pattern *pat,
-             const float   *rot,
-             filter fil, to_img img, to_env env, int n)
-{
-    int i;
-    int j;
-    int f;
-
-    /* Sample all destination rows, columns, and pages. */
-
-    #pragma omp parallel for private(j, f)
-    for         (i = 0; i < dst->h; i++)
-        for     (j = 0; j < dst->w; j++)
-            for (f = 0; f <      n; f++)
-                supersample(src, dst, pat, rot, fil, img, env, f, i, j);
-}
-
-/*----------------------------------------------------------------------------*/
-
 static point cent_points[] = {
     { 0.5f, 0.5f },
 };
@@ -861,17 +832,701 @@ static const pattern box2_pattern = {  4, box2_points };
 static const pattern box3_pattern = {  9, box3_points };
 static const pattern box4_pattern = { 16, box4_points };
 
+/*----------------------------------------------------------------------------*/
+/* A remap is specialized at compile time for the input and output           */
+/* projections, the filter and the pattern so they are inlined in the loops.  */
+/* The runtime selection is done once by select_remap.                        */
+
+struct remap
+{
+    const pattern *pat;
+    filter         fil;
+
+    /* Sample all destination rows, columns, and n pages. */
+
+    void (*process)(const image *src, const image *dst, const float *rot, int n);
+
+    /* Compute the source locations of the samples of the m rows from row */
+    /* i0 of the destination page f. The source has h rows and w columns. */
+
+    void (*locate)(location *loc, const image *dst, const float *rot,
+                   int h, int w, int f, int i0, int m);
+};
+
+typedef struct remap remap;
+
+template <to_img IMG, to_env ENV, filter FIL, const pattern *PAT>
+static inline void supersample(const image *src,
+                               const image *dst,
+                               const float *rot, int f, int i, int j)
+{
+    int    F;
+    float  I;
+    float  J;
+    int    k;
+    int    c = 0;
+    float *p = dst[f].p + dst[f].c * (dst[f].w * i + j);
+
+    /* For each sample of the supersampling pattern... */
+
+    for (k = 0; k < PAT->n; k++)
+    {
+        const float ii = PAT->p[k].i + i;
+        const float jj = PAT->p[k].j + j;
+
+        /* Project and unproject giving the source location. Sample there. */
+
+        float v[3];
+
+        if (ENV( f, ii, jj, dst->h, dst->w, v) && xfm(rot, v) &&
+            IMG(&F, &I, &J, src->h, src->w, v))
+        {
+            FIL(src + F, I, J, p);
+            c++;
+        }
+    }
+
+    /* Normalize the sample. */
+
+    for (k = 0; k < dst->c; k++)
+        p[k] /= c;
+}
+
+template <to_img IMG, to_env ENV, filter FIL, const pattern *PAT>
+static void process(const image *src, const image *dst, const float *rot, int n)
+{
+    int i;
+    int j;
+    int f;
+
+    /* Sample all destination rows, columns, and pages. */
+
+    #pragma omp parallel for private(j, f)
+    for         (i = 0; i < dst->h; i++)
+        for     (j = 0; j < dst->w; j++)
+            for (f = 0; f <      n; f++)
+                supersample<IMG, ENV, FIL, PAT>(src, dst, rot, f, i, j);
+}
+
+template <to_img IMG, to_env ENV, const pattern *PAT>
+static void locate(location *loc, const image *dst, const float *rot,
+                   int h, int w, int f, int i0, int m)
+{
+    int i;
+    int j;
+    int k;
+
+    #pragma omp parallel for private(j, k)
+    for         (i = 0; i < m;      i++)
+        for     (j = 0; j < dst->w; j++)
+            for (k = 0; k < PAT->n; k++)
+            {
+                location *l = loc + (i * dst->w + j) * PAT->n + k;
+
+                const float ii = PAT->p[k].i + i0 + i;
+                const float jj = PAT->p[k].j + j;
+
+                float v[3];
+
+                if (!(ENV( f, ii, jj, dst->h, dst->w, v) && xfm(rot, v) &&
+                      IMG(&l->f, &l->i, &l->j, h, w, v)))
+                    l->f = -1;
+            }
+}
+
+template <to_img IMG, to_env ENV, filter FIL, const pattern *PAT>
+static int select_kernel(remap *R)
+{
+    R->pat     = PAT;
+    R->fil     = FIL;
+    R->process = process<IMG, ENV, FIL, PAT>;
+    R->locate  = locate <IMG, ENV, PAT>;
+    return 1;
+}
+
+template <to_img IMG, to_env ENV, filter FIL>
+static int select_pattern(remap *R, const char *p)
+{
+    if      (!strcmp(p, "cent")) return select_kernel<IMG, ENV, FIL, &cent_pattern>(R);
+    else if (!strcmp(p, "rgss")) return select_kernel<IMG, ENV, FIL, &rgss_pattern>(R);
+    else if (!strcmp(p, "box2")) return select_kernel<IMG, ENV, FIL, &box2_pattern>(R);
+    else if (!strcmp(p, "box3")) return select_kernel<IMG, ENV, FIL, &box3_pattern>(R);
+    else if (!strcmp(p, "box4")) return select_kernel<IMG, ENV, FIL, &box4_pattern>(R);
+    return 0;
+}
+
+template <to_img IMG, to_env ENV>
+static int select_filter(remap *R, const char *f, const char *p)
+{
+    if      (!strcmp(f, "linear"))  return select_pattern<IMG, ENV, filter_linear >(R, p);
+    else if (!strcmp(f, "nearest")) return select_pattern<IMG, ENV, filter_nearest>(R, p);
+    return 0;
+}
+
+template <to_img IMG>
+static int select_output(remap *R, const char *o, const char *f, const char *p)
+{
+    if      (!strcmp(o, "cube")) return select_filter<IMG, cube_to_env>(R, f, p);
+    else if (!strcmp(o, "dome")) return select_filter<IMG, dome_to_env>(R, f, p);
+    else if (!strcmp(o, "hemi")) return select_filter<IMG, hemi_to_env>(R, f, p);
+    else if (!strcmp(o, "ball")) return select_filter<IMG, ball_to_env>(R, f, p);
+    else if (!strcmp(o, "rect")) return select_filter<IMG, rect_to_env>(R, f, p);
+    return 0;
+}
+
+static int select_remap(remap *R, const char *i, const char *o, const char *f, const char *p)
+{
+    if      (!strcmp(i, "cube")) return select_output<cube_to_img>(R, o, f, p);
+    else if (!strcmp(i, "dome")) return select_output<dome_to_img>(R, o, f, p);
+    else if (!strcmp(i, "hemi")) return select_output<hemi_to_img>(R, o, f, p);
+    else if (!strcmp(i, "ball")) return select_output<ball_to_img>(R, o, f, p);
+    else if (!strcmp(i, "rect")) return select_output<rect_to_img>(R, o, f, p);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* The source locations of the samples only depend on the projections, the   */
+/* sizes, the pattern and the rotation. They can be computed once in a table  */
+/* and the remap becomes a gather of the source.                              */
+
+/* Accumulate and normalize the samples of a pixel like supersample does.    */
+
+static inline void gather(const image *src, const location *l, int n,
+                          filter fil, float *p, int c)
+{
+    int k;
+    int s = 0;
+
+    for (k = 0; k < n; k++)
+        if (l[k].f >= 0)
+        {
+            fil(src + l[k].f, l[k].i, l[k].j, p);
+            s++;
+        }
+
+    for (k = 0; k < c; k++)
+        p[k] /= s;
+}
+
+/* Same as process using the locations of a table.                           */
+
+static void process_table(const image    *src,
+                          const image    *dst,
+                          const location *table,
+                          const remap    *R, int n)
+{
+    const int s = R->pat->n;
+
+    int i;
+    int j;
+    int f;
+
+    #pragma omp parallel for private(j, f)
+    for         (i = 0; i < dst->h; i++)
+        for     (j = 0; j < dst->w; j++)
+            for (f = 0; f <      n; f++)
+                gather(src, table + ((f * dst->h + i) * dst->w + j) * s,
+                       s, R->fil, dst[f].p + dst[f].c * (dst[f].w * i + j),
+                       dst[f].c);
+}
+
+/* The table file is a header describing the geometry then the locations.   */
+
+struct table_header
+{
+    char  magic[4];
+    char  i[8];       // input type
+    char  o[8];       // output type
+    char  p[8];       // pattern
+    int   h;          // source size
+    int   w;
+    int   n;          // destination size and pages
+    int   num;
+    float rot[3];
+};
+
+typedef struct table_header table_header;
+
+static void table_init(table_header *H, const char *i, const char *o,
+                       const char *p, int h, int w, int n, int num,
+                       const float *rot)
+{
+    memset(H, 0, sizeof (table_header));
+    memcpy(H->magic, "ERT1", 4);
+    strncpy(H->i, i, sizeof (H->i) - 1);
+    strncpy(H->o, o, sizeof (H->o) - 1);
+    strncpy(H->p, p, sizeof (H->p) - 1);
+    H->h      = h;
+    H->w      = w;
+    H->n      = n;
+    H->num    = num;
+    H->rot[0] = rot[0];
+    H->rot[1] = rot[1];
+    H->rot[2] = rot[2];
+}
+
+/* Allocate and compute the table of all the destination pages.             */
+
+static location *table_build(const image *dst,
+                             const remap *R,
+                             const float *rot, int h, int w, int n)
+{
+    const size_t page = (size_t) dst->h * dst->w * R->pat->n;
+
+    location *table;
+    int f;
+
+    if ((table = (location *) malloc(n * page * sizeof (location))))
+        for (f = 0; f < n; f++)
+            R->locate(table + f * page, dst, rot, h, w, f, 0, dst->h);
+
+    return table;
+}
+
+/* Load the table from the named file if it matches the header H.           */
+
+static location *table_read(const char *name, const table_header *H, size_t count)
+{
+    location    *table = 0;
+    table_header h;
+    FILE        *fp;
+
+    if ((fp = fopen(name, "rb")))
+    {
+        if (fread(&h, sizeof (table_header), 1, fp) == 1 &&
+            memcmp(&h, H, sizeof (table_header)) == 0 &&
+            (table = (location *) malloc(count * sizeof (location))))
+        {
+            if (fread(table, sizeof (location), count, fp) != count)
+            {
+                free(table);
+                table = 0;
+            }
+        }
+        fclose(fp);
+    }
+    return table;
+}
+
+static void table_write(const char *name, const table_header *H,
+                        const location *table, size_t count)
+{
+    FILE *fp;
+
+    if ((fp = fopen(name, "wb")))
+    {
+        if (fwrite(H,     sizeof (table_header), 1,     fp) != 1 ||
+            fwrite(table, sizeof (location),     count, fp) != count)
+            fprintf(stderr, "Failed to write %s\n", name);
+        fclose(fp);
+    }
+}
+
+/* Return the table of the file, computing and writing it when the file     */
+/* does not exist or was made with other parameters.                         */
+
+static location *table_get(const char    *name,
+                           const char    *i,
+                           const char    *o,
+                           const char    *p,
+                           const image   *dst,
+                           const remap   *R,
+                           const float   *rot, int h, int w, int n)
+{
+    const size_t count = (size_t) n * dst->h * dst->w * R->pat->n;
+
+    table_header H;
+    location    *table;
+
+    table_init(&H, i, o, p, h, w, dst->h, n, rot);
+
+    if ((table = table_read(name, &H, count)) == 0)
+    {
+        if ((table = table_build(dst, R, rot, h, w, n)))
+            table_write(name, &H, table, count);
+    }
+    return table;
+}
+
+/* Open the table file for a remap by bands. When the file matches H and   */
+/* holds count locations it is opened for reading and *match is set, else  */
+/* it is created with the header H and the bands are appended to it.       */
+
+static FILE *table_open(const char *name, const table_header *H, size_t count,
+                        int *match)
+{
+    table_header h;
+    FILE        *fp;
+
+    *match = 0;
+
+    if ((fp = fopen(name, "rb")))
+    {
+        if (fread(&h, sizeof (table_header), 1, fp) == 1 &&
+            memcmp(&h, H, sizeof (table_header)) == 0 &&
+            fseeko(fp, 0, SEEK_END) == 0 &&
+            ftello(fp) == (off_t) (sizeof (table_header) +
+                                   count * sizeof (location)))
+        {
+            *match = 1;
+            return fp;
+        }
+        fclose(fp);
+    }
+
+    if ((fp = fopen(name, "wb")))
+    {
+        if (fwrite(H, sizeof (table_header), 1, fp) != 1)
+        {
+            fprintf(stderr, "Failed to write %s\n", name);
+            fclose(fp);
+            fp = 0;
+        }
+    }
+    return fp;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Time the analytic and the table remaps of the same images.               */
+
+static void benchmark(const image *src,
+                      const image *dst,
+                      const remap *R,
+                      const float *rot, int n)
+{
+    const size_t size = (size_t) dst->h * dst->w * dst->c * sizeof (float);
+
+    image    *tmp = image_alloc(n, dst->h, dst->w, dst->c, dst->b, dst->s);
+    location *table;
+    double    t0, t1, t2, t3;
+    int       f, same = 1;
+
+    t0 = now();
+    R->process(src, dst, rot, n);
+    t1 = now();
+    table = table_build(dst, R, rot, src->h, src->w, n);
+    t2 = now();
+    process_table(src, tmp, table, R, n);
+    t3 = now();
+
+    for (f = 0; f < n; f++)
+        same = same && memcmp(dst[f].p, tmp[f].p, size) == 0;
+
+    printf("analytic %.3fs, table build %.3fs, table %.3fs (%.1fx), %.1f MB, output %s\n",
+           t1 - t0, t2 - t1, t3 - t2, (t1 - t0) / (t3 - t2),
+           n * (double) dst->h * dst->w * R->pat->n * sizeof (location) / (1024 * 1024),
+           same ? "identical" : "different");
+
+    free(table);
+}
+
+
+/*----------------------------------------------------------------------------*/
+/* Streaming remap of a single page source bigger than the memory budget.    */
+/* The destination is processed by bands of rows. For each band the source    */
+/* locations of all the samples are computed first, this gives the source     */
+/* scanlines to read, which are kept in a LRU cache of tiles of rows. Then    */
+/* the samples are filtered and the band is written to the output. The math   */
+/* is the same than process so the result does not change.                    */
+/* Only the source is streamed, a cube source is always loaded because of its  */
+/* borders.                                                                    */
+
+#define STREAM_BAND 16
+
+struct stream
+{
+    TIFF      *T;
+    image      img;      // source size and format, r points into the tiles
+    int        rows;     // rows per tile
+    int        n;        // number of tiles
+    float    **tile;     // tile data, 0 when not in cache
+    unsigned  *used;     // last band which used the tile
+    char      *need;     // tile is needed by the current band
+    int        count;    // tiles in cache
+    int        capacity; // tiles allowed by the memory budget
+    int        warned;
+};
+
+typedef struct stream stream;
+
+static int stream_open(stream *S, const char *name, size_t budget)
+{
+    uint16 b, c, s = 0;
+    uint32 w, h, rows = 0;
+
+    memset(S, 0, sizeof (stream));
+
+    if ((S->T = TIFFOpen(name, "r")) == 0)
+        return 0;
+
+    TIFFGetField(S->T, TIFFTAG_IMAGEWIDTH,      &w);
+    TIFFGetField(S->T, TIFFTAG_IMAGELENGTH,     &h);
+    TIFFGetField(S->T, TIFFTAG_SAMPLESPERPIXEL, &c);
+    TIFFGetField(S->T, TIFFTAG_BITSPERSAMPLE,   &b);
+    TIFFGetField(S->T, TIFFTAG_SAMPLEFORMAT,    &s);
+    TIFFGetField(S->T, TIFFTAG_ROWSPERSTRIP,    &rows);
+
+    S->img.w = (int) w;
+    S->img.h = (int) h;
+    S->img.c = (int) c;
+    S->img.b = (int) b;
+    S->img.s = (int) s;
+
+    /* Tiles match the strips so each strip is decoded once per read. */
+
+    S->rows = (rows > 0 && rows <= 256) ? (int) rows : 16;
+    S->n    = (S->img.h + S->rows - 1) / S->rows;
+
+    const size_t size = (size_t) S->rows * w * c * sizeof (float);
+
+    S->capacity = (int) (budget / size);
+    if (S->capacity < 2)
+        S->capacity = 2;
+
+    S->tile = (float  **) calloc(S->n, sizeof (float *));
+    S->used = (unsigned *) calloc(S->n, sizeof (unsigned));
+    S->need = (char     *) calloc(S->n, sizeof (char));
+    S->img.r = (float **) calloc(S->img.h, sizeof (float *));
+
+    return S->tile && S->used && S->need && S->img.r;
+}
+
+static void stream_close(stream *S)
+{
+    int t;
+
+    for (t = 0; t < S->n; t++)
+        free(S->tile[t]);
+
+    free(S->tile);
+    free(S->used);
+    free(S->need);
+    free(S->img.r);
+
+    if (S->T) TIFFClose(S->T);
+}
+
+/* Make all the tiles flagged in need resident, evicting the least recently  */
+/* used ones which are not needed.                                            */
+
+static int stream_fetch(stream *S, unsigned band)
+{
+    const int w = S->img.w * S->img.c;
+    int t, u, r;
+
+    for (t = 0; t < S->n; t++)
+    {
+        if (!S->need[t])
+            continue;
+
+        S->used[t] = band;
+
+        if (S->tile[t])
+            continue;
+
+        if (S->count >= S->capacity)
+        {
+            int lru = -1;
+
+            for (u = 0; u < S->n; u++)
+                if (S->tile[u] && !S->need[u] &&
+                    (lru < 0 || S->used[u] < S->used[lru]))
+                    lru = u;
+
+            if (lru >= 0)
+            {
+                free(S->tile[lru]);
+                S->tile[lru] = 0;
+                S->count--;
+
+                for (r = lru * S->rows; r < S->img.h && r < (lru + 1) * S->rows; r++)
+                    S->img.r[r] = 0;
+            }
+            else if (!S->warned)
+            {
+                fprintf(stderr, "memory budget too small, it will be exceeded\n");
+                S->warned = 1;
+            }
+        }
+
+        if ((S->tile[t] = (float *) malloc((size_t) S->rows * w * sizeof (float))) == 0)
+            return 0;
+
+        S->count++;
+
+        for (r = t * S->rows; r < S->img.h && r < (t + 1) * S->rows; r++)
+        {
+            S->img.r[r] = S->tile[t] + (r - t * S->rows) * w;
+            TIFFReadFloatScanline(S->T, S->img.r[r], r);
+        }
+    }
+    return 1;
+}
+
+/* Flag the tiles containing the rows read by a filter at row i.             */
+
+static void stream_need(stream *S, float i)
+{
+    const float ii = clamp(i - 0.5f, 0.0f, S->img.h - 1.0f);
+
+    S->need[lrintf(floorf(ii)) / S->rows] = 1;
+    S->need[lrintf(ceilf (ii)) / S->rows] = 1;
+}
+
+/* Filter the samples of columns j0 to j1 of a band like supersample does.  */
+/* When the source rows they use do not fit in the budget, which happens   */
+/* when a row of the band crosses a pole, the columns are split.            */
+
+static int stream_filter(stream *S, const location *loc, float *out,
+                         int m, int w, int c, const pattern *pat, filter fil,
+                         int j0, int j1, unsigned *band)
+{
+    int i, j, k, t, count = 0;
+
+    memset(S->need, 0, S->n);
+
+    for         (i = 0;  i < m;      i++)
+        for     (j = j0; j < j1;     j++)
+            for (k = 0;  k < pat->n; k++)
+            {
+                const location *l = loc + (i * w + j) * pat->n + k;
+
+                if (l->f >= 0)
+                    stream_need(S, l->i);
+            }
+
+    for (t = 0; t < S->n; t++)
+        count += S->need[t];
+
+    if (count > S->capacity && j1 - j0 > 1)
+    {
+        const int jm = (j0 + j1) / 2;
+
+        return stream_filter(S, loc, out, m, w, c, pat, fil, j0, jm, band) &&
+               stream_filter(S, loc, out, m, w, c, pat, fil, jm, j1, band);
+    }
+
+    if (!stream_fetch(S, ++(*band)))
+        return 0;
+
+    #pragma omp parallel for private(j)
+    for     (i = 0;  i < m;  i++)
+        for (j = j0; j < j1; j++)
+            gather(&S->img, loc + (i * w + j) * pat->n, pat->n, fil,
+                   out + (i * w + j) * c, c);
+
+    return 1;
+}
+
+/* The table, when given, is read or written one band at a time so it does */
+/* not take more memory than the locations of a band.                      */
+
+static int process_stream(stream         *S,
+                          const char     *name,
+                          const image    *dst,
+                          FILE           *table,
+                          int             match,
+                          const remap    *R,
+                          const float    *rot, int n)
+{
+    const pattern *pat = R->pat;
+
+    const int w = dst->w;
+    const int c = dst->c;
+
+    TIFF     *T   = 0;
+    float    *out = (float    *) malloc((size_t) STREAM_BAND * w * c * sizeof (float));
+    location *buf = (location *) malloc((size_t) STREAM_BAND * w * pat->n * sizeof (location));
+    unsigned  band = 0;
+    int       ok = 0;
+    int       f, i0, i;
+
+    if (out && buf && (T = TIFFOpen(name, "w")))
+    {
+        ok = 1;
+
+        for (f = 0; ok && f < n; f++)
+        {
+            image_fields(T, dst);
+
+            for (i0 = 0; ok && i0 < dst->h; i0 += STREAM_BAND)
+            {
+                const int m = (dst->h - i0 < STREAM_BAND) ? dst->h - i0 : STREAM_BAND;
+
+                /* Find the source location of each sample of the band. */
+
+                const size_t count = (size_t) m * w * pat->n;
+
+                if (table && match)
+                {
+                    const off_t offset = sizeof (table_header) +
+                        ((size_t) f * dst->h + i0) * w * pat->n * sizeof (location);
+
+                    if (fseeko(table, offset, SEEK_SET) != 0 ||
+                        fread(buf, sizeof (location), count, table) != count)
+                    {
+                        fprintf(stderr, "Failed to read the table\n");
+                        ok = 0;
+                        break;
+                    }
+                }
+                else
+                {
+                    R->locate(buf, dst, rot, S->img.h, S->img.w, f, i0, m);
+
+                    /* Bands come in order so the table is appended. */
+
+                    if (table && fwrite(buf, sizeof (location), count, table) != count)
+                    {
+                        fprintf(stderr, "Failed to write the table\n");
+                        table = 0;
+                    }
+                }
+
+                /* Read the source rows they use and filter them. */
+
+                memset(out, 0, (size_t) m * w * c * sizeof (float));
+
+                ok = stream_filter(S, buf, out, m, w, c, pat, R->fil, 0, w, &band);
+
+                for (i = 0; ok && i < m; i++)
+                    TIFFWriteFloatScanline(T, out + i * w * c, i0 + i);
+            }
+            TIFFWriteDirectory(T);
+        }
+        TIFFClose(T);
+    }
+
+    free(buf);
+    free(out);
+
+    return ok;
+}
+
 /*----------------------------------------------------------------------------*/
 
 static int usage(const char *exe)
 {
     fprintf(stderr,
-            "%s [-i input] [-o output] [-p pattern] [-f filter] [-n n] src dst\n"
+            "%s [-i input] [-o output] [-p pattern] [-f filter] [-n n] [-m MB] [-t table] [-B] src dst\n"
             "\t-i ... Input  file type: cube, dome, hemi, ball, rect  [rect]\n"
             "\t-o ... Output file type: cube, dome, hemi, ball, rect  [rect]\n"
             "\t-p ... Sample pattern: cent, rgss, box2, box3, box4    [rgss]\n"
             "\t-f ... Filter type: nearest, linear                  [linear]\n"
-            "\t-n ... Output size                                     [1024]\n",
+            "\t-n ... Output size                                     [1024]\n"
+            "\t-m ... Memory budget in MB, stream the source rows      [off]\n"
+            "\t       (not used with a cube input)\n"
+            "\t-t ... Table of the source locations, computed and written\n"
+            "\t       if the file does not match the parameters    [off]\n"
+            "\t       (read and written by bands with -m)\n"
+            "\t-B ... Benchmark the table against the analytic remap [off]\n"
+            "\t       (not with -m)\n",
             exe);
     return 0;
 }
@@ -887,12 +1542,16 @@ int main(int argc, char **argv)
 
     float rot[3] = { 0.f, 0.f, 0.f };
 
+    const char *t = 0;
+
     int n = 1024;
+    int m = 0;
+    int B = 0;
     int c;
 
     /* Parse the command line options. */
 
-    while ((c = getopt(argc, argv, "i:o:p:n:f:x:y:z:")) != -1)
+    while ((c = getopt(argc, argv, "i:o:p:n:f:x:y:z:m:t:B")) != -1)
         switch (c)
         {
             case 'i': i      = optarg;               break;
@@ -903,6 +1562,9 @@ int main(int argc, char **argv)
             case 'y': rot[1] = strtod(optarg, 0);    break;
             case 'z': rot[2] = strtod(optarg, 0);    break;
             case 'n': n      = strtol(optarg, 0, 0); break;
+            case 'm': m      = strtol(optarg, 0, 0); break;
+            case 't': t      = optarg;               break;
+            case 'B': B      = 1;                    break;
 
             default: return usage(argv[0]);
         }
@@ -911,47 +1573,82 @@ int main(int argc, char **argv)
     image   *src = 0;
     image   *dst = 0;
     image   *tmp = 0;
-    to_img   img;
-    to_env   env;
-    filter   fil;
+    remap    R;
 
-    /* Select the sampler. */
+    /* Select the remap kernel of the projections, sampler, and pattern. */
 
-    if      (!strcmp(f, "linear"))  fil = filter_linear;
-    else if (!strcmp(f, "nearest")) fil = filter_nearest;
-    else return usage(argv[0]);
+    if (!select_remap(&R, i, o, f, p))
+        return usage(argv[0]);
 
-    /* Read the input image. */
+    /* Stream the input image when a memory budget is given. */
 
-    if (optind + 2 <= argc)
+    if (m > 0 && optind + 2 <= argc && strcmp(i, "cube"))
     {
-        if      (!strcmp(i, "cube"))
-        {
-            tmp = image_reader(argv[optind], 6);
-            src = image_border(tmp);
-            img = cube_to_img;
-        }
-        else if (!strcmp(i, "dome"))
+        stream S;
+        image  out;
+
+        memset(&out, 0, sizeof (image));
+        out.h = n;
+        out.w = n;
+
+        if      (!strcmp(o, "cube")) num = 6;
+        else if (!strcmp(o, "rect")) out.w = 2 * n;
+
+        /* The band buffers are taken from the budget, the rest is for the */
+        /* source rows.                                                    */
+
+        size_t budget = (size_t) m * 1024 * 1024;
+        size_t bands  = (size_t) STREAM_BAND * out.w * (4 * sizeof (float) +
+                                                        R.pat->n * sizeof (location));
+
+        budget = (budget > bands) ? budget - bands : 0;
+
+        int ok = 0;
+
+        if (B)
         {
-            src = image_reader(argv[optind], 1);
-            img = dome_to_img;
+            fprintf(stderr, "-B can not be used with -m\n");
+            return 1;
         }
-        else if (!strcmp(i, "hemi"))
+
+        if (stream_open(&S, argv[optind], budget))
         {
-            src = image_reader(argv[optind], 1);
-            img = hemi_to_img;
+            FILE *table = 0;
+            int   match = 0;
+
+            out.c = S.img.c;
+            out.b = S.img.b;
+            out.s = S.img.s ? S.img.s : (S.img.b == 32 ? SAMPLEFORMAT_IEEEFP
+                                                        : SAMPLEFORMAT_UINT);
+
+            if (t)
+            {
+                table_header H;
+
+                table_init(&H, i, o, p, S.img.h, S.img.w, out.h, num, rot);
+                table = table_open(t, &H, (size_t) num * out.h * out.w * R.pat->n, &match);
+            }
+
+            ok = process_stream(&S, argv[optind + 1], &out, table, match, &R, rot, num);
+
+            if (table) fclose(table);
         }
-        else if (!strcmp(i, "ball"))
+        stream_close(&S);
+
+        return ok ? 0 : 1;
+    }
+
+    /* Read the input image. */
+
+    if (optind + 2 <= argc)
+    {
+        if (!strcmp(i, "cube"))
         {
-            src = image_reader(argv[optind], 1);
-            img = ball_to_img;
+            tmp = image_reader(argv[optind], 6);
+            src = image_border(tmp);
         }
-        else if (!strcmp(i, "rect"))
-        {
+        else
             src = image_reader(argv[optind], 1);
-            img = rect_to_img;
-        }
-        else return usage(argv[0]);
     }
     else return usage(argv[0]);
 
@@ -960,53 +1657,30 @@ int main(int argc, char **argv)
     if (src)
     {
         if      (!strcmp(o, "cube"))
-        {
-            dst = image_alloc((num = 6), n, n, src->c, src->b, src->s);
-            env = cube_to_env;
-        }
-        else if (!strcmp(o, "dome"))
-        {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = dome_to_env;
-        }
-        else if (!strcmp(o, "hemi"))
-        {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = hemi_to_env;
-        }
-        else if (!strcmp(o, "ball"))
-        {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = ball_to_env;
-        }
+            dst = image_alloc((num = 6), n,     n, src->c, src->b, src->s);
         else if (!strcmp(o, "rect"))
-        {
             dst = image_alloc((num = 1), n, 2 * n, src->c, src->b, src->s);
-            env = rect_to_env;
-        }
-        else return usage(argv[0]);
+        else
+            dst = image_alloc((num = 1), n,     n, src->c, src->b, src->s);
     }
 
     /* Perform the remapping using the selected pattern. */
 
     if (src && dst)
     {
-        if      (!strcmp(p, "cent"))
-            process(src, dst, &cent_pattern, rot, fil, img, env, num);
-
-        else if (!strcmp(p, "rgss"))
-            process(src, dst, &rgss_pattern, rot, fil, img, env, num);
+        location *table = 0;
 
-        else if (!strcmp(p, "box2"))
-            process(src, dst, &box2_pattern, rot, fil, img, env, num);
+        if (B)
+            benchmark(src, dst, &R, rot, num);
 
-        else if (!strcmp(p, "box3"))
-            process(src, dst, &box3_pattern, rot, fil, img, env, num);
+        else if (t && (table = table_get(t, i, o, p, dst, &R, rot,
+                                         src->h, src->w, num)))
+            process_table(src, dst, table, &R, num);
 
-        else if (!strcmp(p, "box4"))
-            process(src, dst, &box4_pattern, rot, fil, img, env, num);
+        else
+            R.process(src, dst, rot, num);
 
-        else return usage(argv[0]);
+        free(table);
 
         /* Write the output. */
 
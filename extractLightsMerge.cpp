@@ -1,21 +1,76 @@
 /* -*-c++-*- */
 
+/**
+ * Direction of the point u, v of a cubemap face, u and v are in [0 1] on
+ * the face, the face layout is the one of the cube projection of envremap.
+ */
+void cubeFaceDirection(const int face, const double u, const double v, Vec3d& dir)
+{
+    const double x = 2.0 * u - 1.0;
+    const double y = 2.0 * v - 1.0;
+
+    for (int k = 0; k < 3; ++k)
+        dir[k] = CubemapFace[face][0][k] * x + CubemapFace[face][1][k] * y + CubemapFace[face][2][k];
+
+    dir.normalize();
+}
+
+/**
+ * Face and coordinates in [0 1] on the face of a direction.
+ */
+void cubeFaceCoordinates(const Vec3d& dir, int& face, double& u, double& v)
+{
+    int bestAxis = 0;
+    if ( fabs(dir[1]) > fabs(dir[0]) ) {
+        bestAxis = 1;
+        if ( fabs(dir[2]) > fabs(dir[1]) )
+            bestAxis = 2;
+    } else if ( fabs(dir[2]) > fabs(dir[0]) )
+        bestAxis = 2;
+
+    face = bestAxis*2 + ( dir[bestAxis] > 0 ? 0 : 1 );
+    const double ma = fabs(dir[bestAxis]);
+
+    double sc = 0.0, tc = 0.0;
+    for (int k = 0; k < 3; ++k) {
+        sc += CubemapFace[face][0][k] * dir[k];
+        tc += CubemapFace[face][1][k] * dir[k];
+    }
+
+    u = (sc / ma + 1.0) * 0.5;
+    v = (tc / ma + 1.0) * 0.5;
+}
+
+/**
+ * Panorama coordinates in [0 1] of a direction, like the rect projection of
+ * envremap, so the lights of a cubemap are output like the ones of the
+ * panorama it comes from.
+ */
+void directionToPanorama(const Vec3d& dir, Vec2d& position)
+{
+    position[0] = 0.5 + atan2(dir[0], -dir[2]) / (2.0 * PI);
+    position[1] = acos(std::max(-1.0, std::min(1.0, dir[1]))) / PI;
+}
+
 /**
  * convert Env map Regions to Lights
+ * face is the cubemap face of the table, -1 for a panorama
  */
-void createLightsFromRegions(const SatRegionVector& regions, LightVector& lights, const float *rgba, const double maxLum, const int width, const int height, const int nc, const SummedAreaTable &lumSat)
+void createLightsFromRegions(const SatRegionVector& regions, LightVector& lights, const float *rgba, const double maxLum, const int width, const int height, const int nc, const SummedAreaTable &lumSat, const int face = -1)
 {
     const double maxR = lumSat.getMaxR();
     const double maxG = lumSat.getMaxG();
     const double maxB = lumSat.getMaxB();
-    const double weigth = lumSat.getWeightAccumulation();
 
     const uint imgSize = width*height;
     double weight = (4.0 * PI) / ((double)(imgSize));
 
+    const CubemapNormalizer* normalizer = face < 0 ? 0 : &CubemapNormalizer::get(width, 0);
+
     // convert region into lights
-    for (SatRegionVector::const_iterator region = regions.begin(); region != regions.end(); ++region)
+    for (size_t n = 0; n < regions.size(); ++n)
     {
+        const SatRegion& region = regions[n];
 
         Light l;
 
@@ -23,60 +78,38 @@ void createLightsFromRegions(const SatRegionVector& regions, LightVector& lights
         l._merged = false;
         l._mergedNum = 0;
 
-        l._x = region->_x;
-        l._y = region->_y;
-        l._w = region->_w;
-        l._h = region->_h;
+        l._x = region._x;
+        l._y = region._y;
+        l._w = region._w;
+        l._h = region._h;
 
         // set light at centroid
-        l._centroidPosition = region->centroid();
+        l._centroidPosition = region.centroid();
 
         // light area Size
-        l._areaSize = region->areaSize();
+        l._areaSize = region.areaSize();
 
+        const int cx = static_cast<int>(l._centroidPosition[0]);
+        const int cy = static_cast<int>(l._centroidPosition[1]);
         const uint i = static_cast<uint>(l._centroidPosition[1]*width + l._centroidPosition[0]);
 
-        // compute area values, as SAT introduce precision errors
-        // due to high sum values against small data values
-        // we use here less error inducing computations
+        // luminance of the centroid pixel
         double r = rgba[i*nc + 0];
         double g = rgba[i*nc + 1];
         double b = rgba[i*nc + 2];
-        {
+        if (face < 0) {
             double y = ((double)l._centroidPosition[1] + 1.0) / (double)(height + 1);
             double solidAngle = cos(PI* (y - 0.5)) * weight;
             l._luminancePixel = luminance(r,g,b) * solidAngle;
+        } else {
+            // pondered by the solid angle of the texel
+            l._luminancePixel = luminance(r,g,b) * normalizer->getSolidAngle(cx, cy);
         }
 
-        double rSum = 0.0;
-        double gSum = 0.0;
-        double bSum = 0.0;
-        double lumSum = 0.0;
-
-        for (int y1 = l._y; y1 < l._y+l._h; ++y1)
-        {
-            const double posY = ((double)y1 + 1.0) / (double)(height + 1.0);
-            const double solidAngle = cos(PI* (posY - 0.5)) * weight;
-
-            for (int x1 = l._x; x1 < l._x+l._w;  ++x1)
-            {
-                const uint i = (x1+(y1*width))*nc;
-
-                r = rgba[i];
-                g = rgba[i + 1];
-                b = rgba[i + 2];
-
-                lumSum +=  luminance(r,g,b) * solidAngle;
-
-                rSum += r;
-                gSum += g;
-                bSum += b;
-
-            }
-        }
-
-        // normalize
-        lumSum *= (4.0 * PI)  / weigth;
+        // area values from the tables, the luminance is normalized
+        // like the tables
+        double lumSum, rSum, gSum, bSum;
+        lumSat.sumColors(region._x, region._y, region._w, region._h, lumSum, rSum, gSum, bSum);
         l._sum = lumSum;
 
         l._variance = ((l._sum*l._sum) / l._areaSize) - (l._lumAverage*l._lumAverage);
@@ -97,6 +130,12 @@ void createLightsFromRegions(const SatRegionVector& regions, LightVector& lights
         l._centroidPosition[0] = l._centroidPosition[0] / (double)width;
         l._centroidPosition[1] = l._centroidPosition[1] / (double)height;
 
+        l._face = face;
+        if (face >= 0) {
+            cubeFaceDirection(face, l._centroidPosition[0], l._centroidPosition[1], l._direction);
+            directionToPanorama(l._direction, l._centroidPosition);
+        }
+
         // if value out of bounds
         l._error =  l._sum > maxLum;
         l._sortCriteria = l._areaSize;
@@ -152,6 +191,125 @@ void mergeLight(Light& lightParent, Light& lightChild)
 
 }
 
+/**
+ * true when a touches an edge of its face and the other side of the edge is
+ * in b, on the neighbour face. tolerance is the distance to the edges in
+ * face coordinates.
+ */
+bool intersectLightAcrossSeam(const Light& a, const Light& b, const double tolerance)
+{
+    // edges of a: points along the edge, inset from the corners, and the
+    // coordinate just outside the face
+    const double y0 = std::max(a._y, tolerance), y1 = std::min(a._y + a._h, 1.0 - tolerance);
+    const double x0 = std::max(a._x, tolerance), x1 = std::min(a._x + a._w, 1.0 - tolerance);
+
+    double edges[4][4] = {
+        { -tolerance, y0, -tolerance, y1 },                 // left
+        { 1.0 + tolerance, y0, 1.0 + tolerance, y1 },       // right
+        { x0, -tolerance, x1, -tolerance },                 // top
+        { x0, 1.0 + tolerance, x1, 1.0 + tolerance }        // bottom
+    };
+    const bool touch[4] = {
+        a._x <= tolerance,
+        a._x + a._w >= 1.0 - tolerance,
+        a._y <= tolerance,
+        a._y + a._h >= 1.0 - tolerance
+    };
+
+    for (int e = 0; e < 4; ++e)
+    {
+        if (!touch[e]) continue;
+
+        Vec3d dir;
+        int face0, face1;
+        double u0, v0, u1, v1;
+        cubeFaceDirection(a._face, edges[e][0], edges[e][1], dir);
+        cubeFaceCoordinates(dir, face0, u0, v0);
+        cubeFaceDirection(a._face, edges[e][2], edges[e][3], dir);
+        cubeFaceCoordinates(dir, face1, u1, v1);
+
+        if (face0 != b._face || face1 != b._face) continue;
+
+        // segment on the edge of the neighbour face against b
+        const double sx1 = std::min(u0, u1) - tolerance;
+        const double sx2 = std::max(u0, u1) + tolerance;
+        const double sy1 = std::min(v0, v1) - tolerance;
+        const double sy2 = std::max(v0, v1) + tolerance;
+
+        if (!(b._y > sy2 || b._y+b._h < sy1 || b._x > sx2 || b._x+b._w < sx1))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Merge the lights of a cubemap cut by a face edge with the lights on the
+ * other side of the edge. lights are the merged lights of all the faces,
+ * sorted by sum, a light is merged into the first light it touches.
+ * The parent keeps its face area, its direction is the average of the
+ * directions weighted by the sums.
+ * The areas are split by the faces and not by the cuts, so they are not
+ * bounded by size but by the angle between their directions.
+ */
+uint mergeSeamLights(LightVector& lights, const double degreeMerge, const double tolerance)
+{
+    const double cosMerge = cos(degreeMerge * PI / 360.0);
+
+    // only lights touching an edge can be merged
+    std::vector<uint> seamLights;
+    for (uint i = 0; i < lights.size(); ++i)
+    {
+        const Light& l = lights[i];
+        if (l._x <= tolerance || l._y <= tolerance || l._x + l._w >= 1.0 - tolerance || l._y + l._h >= 1.0 - tolerance)
+            seamLights.push_back(i);
+    }
+
+    uint numMergedLightTotal = 0;
+
+    for (uint i = 0; i < seamLights.size(); ++i)
+    {
+        Light& lCurrent = lights[seamLights[i]];
+        if (lCurrent._merged) continue;
+
+        for (uint j = i + 1; j < seamLights.size(); ++j)
+        {
+            Light& l = lights[seamLights[j]];
+            if (l._merged || l._face == lCurrent._face) continue;
+
+            if (lCurrent._direction * l._direction < cosMerge) continue;
+
+            if (!intersectLightAcrossSeam(lCurrent, l, tolerance) && !intersectLightAcrossSeam(l, lCurrent, tolerance)) continue;
+
+            Vec3d direction = lCurrent._direction * lCurrent._sum + l._direction * l._sum;
+            direction.normalize();
+
+            // the union of areas of two faces is not an area
+            const double x = lCurrent._x, y = lCurrent._y, w = lCurrent._w, h = lCurrent._h;
+            mergeLight(lCurrent, l);
+            lCurrent._x = x; lCurrent._y = y; lCurrent._w = w; lCurrent._h = h;
+
+            lCurrent._direction = direction;
+            directionToPanorama(direction, lCurrent._centroidPosition);
+
+            numMergedLightTotal++;
+        }
+    }
+
+    // remove merged lights
+    LightVector remaining;
+    for (LightVector::iterator l = lights.begin(); l != lights.end(); ++l)
+    {
+        if (!l->_merged) {
+            l->_sortCriteria = l->_sum;
+            remaining.push_back(*l);
+        }
+    }
+    lights.swap(remaining);
+
+    return numMergedLightTotal;
+}
+
 /*
  * not a constructor, not struct member as it's specific for merge
  *  we copy only parts
@@ -167,6 +325,8 @@ void lightCopy(Light &lDest, const Light &lSrc)
     lDest._h = lSrc._h;
     lDest._centroidPosition[0] = lSrc._centroidPosition[0];
     lDest._centroidPosition[1] = lSrc._centroidPosition[1];
+    lDest._face = lSrc._face;
+    lDest._direction = lSrc._direction;
     lDest._areaSize = lSrc._areaSize;
     lDest._sum = lSrc._sum;
     lDest._variance = lSrc._variance;
@@ -200,21 +360,97 @@ bool intersectLightAgainstLights2D(const LightVector &lights, const Light &light
     return false;
 }
 
+/**
+ * Uniform grid of the light rectangles in the [0 1] panorama space.
+ * A light is stored in every cell its rectangle touches, so the lights
+ * intersecting a rectangle are in the cells of that rectangle. Lights
+ * keep their index in the vector, the merges visit the candidates in the
+ * order of a scan of the whole vector.
+ */
+struct LightGrid {
+
+    int _size;
+    std::vector< std::vector<uint> > _cells;
+
+    // lights from begin are indexed
+    void build(const LightVector& lights, const uint begin)
+    {
+        // about one light per cell
+        const uint numLights = lights.size() - std::min<size_t>(begin, lights.size());
+        _size = std::max(1, std::min(256, static_cast<int>(sqrt(static_cast<double>(numLights)))));
+
+        _cells.clear();
+        _cells.resize(_size * _size);
+
+        for (uint i = begin; i < lights.size(); ++i)
+        {
+            const Light& l = lights[i];
+            const int cx1 = cell(l._x), cx2 = cell(l._x + l._w);
+            const int cy1 = cell(l._y), cy2 = cell(l._y + l._h);
+
+            for (int cy = cy1; cy <= cy2; ++cy)
+                for (int cx = cx1; cx <= cx2; ++cx)
+                    _cells[cy*_size + cx].push_back(i);
+        }
+    }
+
+    int cell(const double v) const
+    {
+        const int c = static_cast<int>(floor(v * _size));
+        return std::max(0, std::min(_size - 1, c));
+    }
+
+    // sorted indices greater than after of the lights in the cells of the rectangle
+    void query(const double x1, const double y1, const double x2, const double y2, const int after, std::vector<uint>& result) const
+    {
+        result.clear();
+
+        const int cx1 = cell(x1), cx2 = cell(x2);
+        const int cy1 = cell(y1), cy2 = cell(y2);
+
+        for (int cy = cy1; cy <= cy2; ++cy)
+        {
+            for (int cx = cx1; cx <= cx2; ++cx)
+            {
+                const std::vector<uint>& lights = _cells[cy*_size + cx];
+                for (size_t i = 0; i < lights.size(); ++i)
+                {
+                    if (static_cast<int>(lights[i]) > after) result.push_back(lights[i]);
+                }
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+    }
+};
+
 /**
  * Merge small area light neighbour with small area light neighbours
+ * scaleX and scaleY are the ratios of the light coordinates to the
+ * panorama ones, the lengths and borders are scaled by them, e.g. 4 and 2
+ * for the lights of a cubemap face.
  */
 uint mergeLights(LightVector& lights, LightVector& newLights, const uint width, const uint height,
                  const double areaSizeMax,const double lengthSizeMax,
-                 const double luminanceMaxLight, const double degreeMerge)
+                 const double luminanceMaxLight, const double degreeMerge,
+                 const double scaleX = 1.0, const double scaleY = 1.0)
 {
 
     // discard or keep Light too near an current light
-    const double border = degreeMerge * PI / 360.0;
+    const double borderX = degreeMerge * PI / 360.0 * scaleX;
+    const double borderY = degreeMerge * PI / 360.0 * scaleY;
+    const double lengthSizeMaxW = lengthSizeMax * scaleX;
+    const double lengthSizeMaxH = lengthSizeMax * scaleY;
 
     uint numMergedLightTotal;
 
     numMergedLightTotal = 0;
 
+    LightGrid grid;
+    grid.build(lights, 0);
+    std::vector<uint> candidates;
+
     // for each light we try to merge with all other intersecting lights
     // that are in the same neighborhood of the sorted list of lights
     // where neighbors are of near same values
@@ -228,10 +464,10 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
 
         Light lCurrent;
         lightCopy(lCurrent, *lightIt);
-        double x1 = lCurrent._x - border;
-        double y1 = lCurrent._y - border;
-        double x2 = x1 + lCurrent._w + border;
-        double y2 = y1 + lCurrent._h + border;
+        double x1 = lCurrent._x - borderX;
+        double y1 = lCurrent._y - borderY;
+        double x2 = x1 + lCurrent._w + borderX;
+        double y2 = y1 + lCurrent._h + borderY;
 
         uint numMergedLight;
 
@@ -246,70 +482,78 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
 
             // could start at current light
             // lights is sorted by areasize from small to big
-            for (LightVector::iterator l = lights.begin(); l != lights.end(); ++l) {
+            // the lights are visited in order like a scan of the whole
+            // vector, only the ones near the current borders are tested.
+            // Borders only grow, so after a merge the scan goes on from
+            // the merged light with the new borders
+            int last = -1;
+            bool merged;
 
-                // ignore already merged into another
-                if (l->_merged ) continue;
+            do {
 
-                // ignore itself
-                if (l == lightIt) continue;
+                merged = false;
+                grid.query(x1, y1, x2, y2, last, candidates);
 
-                // if merged do new size will be problematic
-                const double newX =  std::min(lCurrent._x, l->_x);
-                const double newY  = std::min(lCurrent._y, l->_y);
+                for (size_t c = 0; c < candidates.size(); ++c) {
 
-                const double newParentSizeW = std::max(lCurrent._x + lCurrent._w, (l->_x + l->_w)) - newX;
-                if (lengthSizeMax < newParentSizeW) continue;
+                    last = candidates[c];
+                    LightVector::iterator l = lights.begin() + last;
 
-                const double newParentSizeH = std::max(lCurrent._y + lCurrent._h, (l->_y + l->_h)) - newY;
+                    // ignore already merged into another
+                    if (l->_merged ) continue;
 
+                    // ignore itself
+                    if (l == lightIt) continue;
 
-                if (lengthSizeMax < newParentSizeH) continue;
+                    // if merged do new size will be problematic
+                    const double newX =  std::min(lCurrent._x, l->_x);
+                    const double newY  = std::min(lCurrent._y, l->_y);
 
-                bool intersect2D = !(l->_y > y2 || l->_y+l->_h < y1 || l->_x > x2 || l->_x+l->_w < x1);
-                // try left/right border as it's a env wrap
-                // complexity arise, how to merge...and then retest after
-                /*
-                  if (!intersect2D ){
-                  if( x == 0 ){
-                  //check left borders
-                  intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y || l->_x-border > width + w || l->_x+l->_w+border < width);
-                  }else if( x+w == width ){
-                  //check right borders
-                  intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y || l->_x-border > w + (width - x) || l->_x+l->_w+border < (width - x));
-                  }
-                  }
-                */
+                    const double newParentSizeW = std::max(lCurrent._x + lCurrent._w, (l->_x + l->_w)) - newX;
+                    if (lengthSizeMaxW < newParentSizeW) continue;
 
-                //  share borders
-                if (intersect2D)
-                {
+                    const double newParentSizeH = std::max(lCurrent._y + lCurrent._h, (l->_y + l->_h)) - newY;
 
-                    // remove from previous merge if any
-                    for (LightVector::iterator lBigIt = newLights.begin(); lBigIt != newLights.end(); ++lBigIt) {
 
-                        if (l == lBigIt){
+                    if (lengthSizeMaxH < newParentSizeH) continue;
 
-                            newLights.erase(lBigIt);
-                            break;
+                    bool intersect2D = !(l->_y > y2 || l->_y+l->_h < y1 || l->_x > x2 || l->_x+l->_w < x1);
+                    // try left/right border as it's a env wrap
+                    // complexity arise, how to merge...and then retest after
+                    /*
+                      if (!intersect2D ){
+                      if( x == 0 ){
+                      //check left borders
+                      intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y || l->_x-border > width + w || l->_x+l->_w+border < width);
+                      }else if( x+w == width ){
+                      //check right borders
+                      intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y || l->_x-border > w + (width - x) || l->_x+l->_w+border < (width - x));
+                      }
+                      }
+                    */
+
+                    //  share borders
+                    if (intersect2D)
+                    {
 
-                        }
+                        mergeLight(lCurrent, *l);
 
-                    }
+                        x1 = lCurrent._x - borderX;
+                        y1 = lCurrent._y - borderY;
+                        x2 = x1 + lCurrent._w + borderX;
+                        y2 = y1 + lCurrent._h + borderY;
 
-                    mergeLight(lCurrent, *l);
 
-                    x1 = lCurrent._x - border;
-                    y1 = lCurrent._y - border;
-                    x2 = x1 + lCurrent._w + border;
-                    y2 = y1 + lCurrent._h + border;
+                        numMergedLight++;
+                        numMergedLightTotal++;
 
+                        merged = true;
+                        break;
+                    }
 
-                    numMergedLight++;
-                    numMergedLightTotal++;
                 }
 
-            }
+            } while (merged);
 
             // if we're merging we're changing borders
             // means we have new neighbours
@@ -400,33 +644,55 @@ uint selectLights(LightVector& mergedLights, LightVector& newLights, const uint
                 l->_merged = false;
             }
 
+            // children are visited in order, only the ones near the
+            // current borders are tested, see mergeLights
+            LightGrid grid;
+            grid.build(lights, 1);
+            std::vector<uint> candidates;
+
             do {
                 numMergedLight = 0;
 
-                for (LightVector::iterator l = lights.begin()+1; l != lights.end(); ++l)
-                {
-
-                    // ignore already merged or itself
-                    if (l->_merged ) continue;
+                int last = 0;
+                bool merged;
 
+                do {
 
-                    bool intersect2D = !(l->_y > y2 || l->_y+l->_h < y1 || l->_x > x2 || l->_x+l->_w < x1);
+                    merged = false;
+                    grid.query(x1, y1, x2, y2, last, candidates);
 
-                    if (intersect2D && intersectLightAgainstLights2D(lCurrent.childrenLights, *l, border))
+                    for (size_t c = 0; c < candidates.size(); ++c)
                     {
+                        last = candidates[c];
+                        LightVector::iterator l = lights.begin() + last;
 
-                        mergeLight(lCurrent, *l);
+                        // ignore already merged or itself
+                        if (l->_merged ) continue;
+
+
+                        bool intersect2D = !(l->_y > y2 || l->_y+l->_h < y1 || l->_x > x2 || l->_x+l->_w < x1);
+
+                        if (intersect2D && intersectLightAgainstLights2D(lCurrent.childrenLights, *l, border))
+                        {
+
+                            mergeLight(lCurrent, *l);
+
+                            x1 = lCurrent._x - border;
+                            y1 = lCurrent._y - border;
+                            x2 = x1 + lCurrent._w + border;
+                            y2 = y1 + lCurrent._h + border;
+
+                            numMergedLight++;
+
+                            merged = true;
+                            break;
+                        }
 
-                        x1 = lCurrent._x - border;
-                        y1 = lCurrent._y - border;
-                        x2 = x1 + lCurrent._w + border;
-                        y2 = y1 + lCurrent._h + border;
 
-                        numMergedLight++;
                     }
 
+                } while (merged);
 
-                }
             } while (numMergedLight > 0);
 
             lCurrent._sortCriteria = lCurrent._sum;
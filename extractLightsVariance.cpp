@@ -13,6 +13,8 @@
 #include <algorithm>
 #include <float.h>
 
+#include <tbb/task_group.h>
+
 
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/filter.h>
@@ -22,6 +24,7 @@
 OIIO_NAMESPACE_USING
 
 #include "Math"
+#include "Cubemap"
 #include "Light"
 #include "SummedAreaTable"
 #include "SummedAreaTableRegion"
@@ -29,9 +32,29 @@ OIIO_NAMESPACE_USING
 #include "extractLightsMerge.cpp"
 #include "extractLightsVarianceDebug.cpp"
 
+void splitRecursive(const SatRegion& r, const uint n, SatRegionVector& regions);
+
+// remaining cuts above which the two halves of a split are processed in
+// parallel, smaller subtrees are not worth a task
+static const uint parallelCuts = 6;
+
+struct SplitTask {
+    const SatRegion& _region;
+    uint _n;
+    SatRegionVector& _regions;
+
+    SplitTask(const SatRegion& region, uint n, SatRegionVector& regions): _region(region), _n(n), _regions(regions) {}
+
+    void operator()() const {
+        splitRecursive(_region, _n, _regions);
+    }
+};
+
 /**
  * Recursively split a region r and append new subregions
  * A and B to regions vector when at an end.
+ * The subtrees of A and B are split in parallel into their own vectors,
+ * appended in order so the regions are the same as a depth first split.
  */
 void splitRecursive(const SatRegion& r, const uint n, SatRegionVector& regions)
 {
@@ -50,11 +73,28 @@ void splitRecursive(const SatRegion& r, const uint n, SatRegionVector& regions)
     else
         r.split_h(A, B);
 
-    if (A._h > 2 && A._w > 2 ) {
+    const bool splitA = A._h > 2 && A._w > 2;
+    const bool splitB = B._h > 2 && B._w > 2;
+
+    if (n > parallelCuts && splitA && splitB) {
+
+        SatRegionVector regionsA, regionsB;
+
+        tbb::task_group group;
+        group.run(SplitTask(A, n-1, regionsA));
+        splitRecursive(B, n-1, regionsB);
+        group.wait();
+
+        regions.insert(regions.end(), regionsA.begin(), regionsA.end());
+        regions.insert(regions.end(), regionsB.begin(), regionsB.end());
+        return;
+    }
+
+    if (splitA) {
         splitRecursive(A, n-1, regions);
     }
 
-    if (B._h > 2 && B._w > 2 ) {
+    if (splitB) {
         splitRecursive(B, n-1, regions);
     }
 
@@ -97,8 +137,9 @@ void outputJSON(const LightVector &lights, uint height, uint width, uint imageAr
         // under hemisphere, we cull
         if (y >= 0.5) continue;
 
-        const double w = l->_w;
-        const double h = l->_h;
+        // a cubemap face is 90 degrees of the 360 x 180 of the panorama
+        const double w = l->_face < 0 ? l->_w : l->_w / 4.0;
+        const double h = l->_face < 0 ? l->_h : l->_h / 2.0;
 
         // convert x,y to direction
         Vec3d d;
@@ -130,6 +171,11 @@ void outputJSON(const LightVector &lights, uint height, uint width, uint imageAr
         std::cout << " \"luminosity\": " << (l->_lumAverage) << ", ";
         std::cout << " \"color\": [" << rCol << ", " << gCol << ", " << bCol << "], ";
         std::cout << " \"area\": {\"x\":" << x << ", \"y\":" << y << ", \"w\":" << w << ", \"h\":" << h << "}, ";
+        // the area of a cubemap light on its face
+        if (l->_face >= 0) {
+            std::cout << " \"face\": " << l->_face << ", ";
+            std::cout << " \"faceArea\": {\"x\":" << l->_x << ", \"y\":" << l->_y << ", \"w\":" << l->_w << ", \"h\":" << l->_h << "}, ";
+        }
         std::cout << " \"sum\": " << l->_sum << ", ";
         std::cout << " \"lum_ratio\": " << (l->_sum / luminanceSum ) << ", ";
         std::cout << " \"variance\": " << (l->_variance ) << ", ";
@@ -152,10 +198,112 @@ void outputJSON(const LightVector &lights, uint height, uint width, uint imageAr
 ////////////////////////////////////////////////
 static int usage(const std::string& name)
 {
-    std::cerr << "Usage: " << name << " [-a max_light_areas] [-l max_light_length] [-r ratioLight] [-n numCuts] [-m lightsNum] [-d] file.hdr" << std::endl;
+    std::cerr << "Usage: " << name << " [-a max_light_areas] [-l max_light_length] [-r ratioLight] [-n numCuts] [-m lightsNum] [-d] [-c] file.hdr|cubemap.tif" << std::endl;
+    std::cerr << "-c reads a cubemap, a tif with the six faces or a .cbm cache" << std::endl;
     return 1;
 }
 
+/**
+ * Lights of a cubemap, without reprojection to a panorama.
+ * Each face has its table pondered by the solid angle of the texels, it is
+ * cut and its lights are merged like a panorama, then the lights cut by the
+ * face edges are merged across the seams.
+ * A face is 90 degrees of the 360 x 180 degrees of the panorama, so the
+ * lengths are scaled by 4 horizontally and 2 vertically, the areas by 6,
+ * the ratio of the solid angles. Each face is cut numCuts - 2 times to give
+ * about as many regions as a panorama cut numCuts times.
+ * The faces are processed one after the other with the same table, use a
+ * small cubemap, the lights don't need the full resolution.
+ */
+int extractCubemapLights(const std::string& filename, const int numCuts, const double ratioAreaSizeMax, const double ratioLengthSizeMax, const float ratioLuminanceLight, const int numLights)
+{
+    Cubemap cubemap;
+    if (!cubemap.load(filename))
+    {
+        std::cerr << "Cannot open " << filename << " cubemap file" << std::endl;
+        return 1;
+    }
+
+    const Cubemap::MipLevel& level = cubemap.getImages(0);
+    const uint size = level.getSize();
+    const uint nc = level.getSamplePerPixel();
+    if (nc < 3)
+    {
+        std::cerr << "Cubemap " << filename << " needs rgb channels" << std::endl;
+        return 1;
+    }
+
+    const CubemapNormalizer& normalizer = CubemapNormalizer::get(size, 0);
+
+    // solid angle of the six faces
+    double weightAccum = 0.0;
+    for (uint j = 0; j < size; ++j)
+        for (uint i = 0; i < size; ++i)
+            weightAccum += normalizer.getSolidAngle(i, j);
+    weightAccum *= 6.0;
+
+    const uint faceCuts = numCuts > 2 ? numCuts - 2 : 0;
+    const double faceRatioX = 4.0;
+    const double faceRatioY = 2.0;
+    const double faceAreaRatio = 6.0;
+
+    ////////////////////////////////////////////////
+    // summed area table, cuts and lights of each face
+    SummedAreaTable lumSat;
+    std::vector<LightVector> faceLights(6);
+    double luminanceSum = 0.0;
+
+    for (int face = 0; face < 6; ++face)
+    {
+        lumSat.createLumCubeFace(level.imageFace(face), size, nc, normalizer, weightAccum);
+        luminanceSum += lumSat.getSum();
+
+        SatRegionVector regions;
+        medianVarianceCut(lumSat, faceCuts, regions);
+
+        // the max luminance needs the sum of all the faces, the errors
+        // are flagged once it is known
+        createLightsFromRegions(regions, faceLights[face], level.imageFace(face), DBL_MAX, size, size, nc, lumSat, face);
+    }
+
+    const double luminanceMaxLight =  ratioLuminanceLight * luminanceSum;
+    const double degreeMerge = 35.0;
+
+    ////////////////////////////////////////////////
+    // lights of each face merged like a panorama
+    LightVector mainLights;
+
+    for (int face = 0; face < 6; ++face)
+    {
+        LightVector& lights = faceLights[face];
+        for (LightVector::iterator l = lights.begin(); l != lights.end(); ++l)
+            l->_error = l->_sum > luminanceMaxLight;
+
+        // sort lights
+        // the smaller, the more powerful luminance
+        std::sort(lights.begin(), lights.end());
+
+        mergeLights(lights, mainLights, size, size,
+                    ratioAreaSizeMax * faceAreaRatio, ratioLengthSizeMax,
+                    luminanceMaxLight, degreeMerge, faceRatioX, faceRatioY);
+    }
+
+    // biggest Sum first, then merge the lights on both sides of the edges
+    std::sort(mainLights.begin(), mainLights.end());
+    std::reverse(mainLights.begin(), mainLights.end());
+
+    mergeSeamLights(mainLights, degreeMerge, 1.0 / size);
+
+    std::sort(mainLights.begin(), mainLights.end());
+    std::reverse(mainLights.begin(), mainLights.end());
+
+    ////////////////////////////////////////////////
+    // output JSON
+    outputJSON(mainLights, size, size, 6 * size * size, luminanceSum, numLights);
+
+    return 0;
+}
+
 ////////////////////////////////////////////////
 // The Real Deal
 // some examples scripts here for multi or single update:
@@ -181,12 +329,14 @@ int main(int argc, char** argv)
 
     int c;
     bool debug = false;
+    bool cubemapInput = false;
 
-    while ((c = getopt(argc, argv, "a:dl:m:n:r:")) != -1)
+    while ((c = getopt(argc, argv, "a:cdl:m:n:r:")) != -1)
     {
         switch (c)
         {
         case 'a': ratioAreaSizeMax = atof(optarg); break;
+        case 'c': cubemapInput = true; break;
         case 'd': debug = true; break;
         case 'l': ratioLengthSizeMax = atof(optarg); break;
         case 'm': numLights = atoi(optarg); break;
@@ -198,7 +348,14 @@ int main(int argc, char** argv)
     }
 
 
-    if ( optind < argc )
+    if ( optind < argc && cubemapInput )
+    {
+        if (debug)
+            std::cerr << "debug output is only written for a panorama" << std::endl;
+
+        return extractCubemapLights(argv[optind], numCuts, ratioAreaSizeMax, ratioLengthSizeMax, ratioLuminanceLight, numLights);
+    }
+    else if ( optind < argc )
     {
         ////////////////////////////////////////////////
         // load image
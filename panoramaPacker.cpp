@@ -13,10 +13,14 @@
 #include "Math"
 #include "Cubemap"
 #include "Color"
+#include "Planar"
+#include "PackWriter"
 
 OIIO_NAMESPACE_USING
 
 bool writeByChannel = false;
+bool compressOutput = false;
+int compressionLevel = 9;
 
 struct PanoramaRGBA8 {
 
@@ -28,22 +32,23 @@ struct PanoramaRGBA8 {
         _image = new uint8_t[size*size*4];
     }
 
-    void pack( const std::string& file) {
+    // close also reports the failures of open and write
+    bool pack( const std::string& file) {
 
-        FILE* output = fopen( file.c_str(), "wb");
+        PackWriter output;
+        output.open( file, compressOutput, compressionLevel );
 
         if (writeByChannel) {
             // write by channel
-            for ( int c = 0; c < 4; c++ )
-                for ( int b = 0; b < _size*_size; b++ ) {
-                    uint8_t* p = &(_image[b*4]);
-                    fwrite( &p[c], 1, 1 , output );
-                }
+            std::vector<uint8_t> planes;
+            writePlanar( output, _image, 4, _size*_size, planes );
         } else {
 
-            fwrite( _image, _size*_size*4, 1 , output );
+            output.write( _image, _size*_size*4 );
         }
 
+        return output.close();
+
     }
 };
 
@@ -59,22 +64,22 @@ struct PanoramaRGB32 {
         _image = new float[size*size*3];
     }
 
-    void pack( const std::string& file) {
+    bool pack( const std::string& file) {
 
-        FILE* output = fopen( file.c_str(), "wb");
+        PackWriter output;
+        output.open( file, compressOutput, compressionLevel );
 
         if (writeByChannel) {
             // write by channel
-            for ( int c = 0; c < 3; c++ )
-                for ( int b = 0; b < _size*_size; b++ ) {
-                    float* p = &(_image[b*3]);
-                    fwrite( &p[c], 4, 1 , output );
-                }
+            std::vector<float> planes;
+            writePlanar( output, _image, 3, _size*_size, planes );
         } else {
 
-            fwrite( _image, _size*_size*3*4, 1 , output );
+            output.write( _image, _size*_size*3*4 );
         }
 
+        return output.close();
+
     }
 };
 
@@ -95,11 +100,15 @@ public:
 
     int _maxLevel;
 
+    // false when an output could not be written
+    bool _written;
+
     Packer(const std::string& filenamePattern, int level, const std::string& outputDirectory ) {
         _filePattern = filenamePattern;
         _maxLevel = level;
         _outputDirectory = outputDirectory;
         _rgbe = _float = _rgbm = _luv = false;
+        _written = true;
     }
 
     void setRGBE( bool state ) { _rgbe = state; }
@@ -187,7 +196,7 @@ public:
         }
 
         if ( _float ) {
-            _FLOAT.pack(_outputDirectory + "_float.bin");
+            _written = _FLOAT.pack(_outputDirectory + "_float.bin") && _written;
             //imageMip->write("/tmp/debug_panorama_prefilter.tif");
         }
 
@@ -202,86 +211,27 @@ public:
         _RGBM.init(size);
         _LUV.init(size);
 
-        ImageBuf::Iterator<float, float> iteratorSrc(*image, 0, size, 0, size);
-
-
-        ImageSpec specOutRGBE(size, size, 4, TypeDesc::UINT8 );
-        specOutRGBE.attribute("oiio:UnassociatedAlpha", 1);
-
-        ImageSpec specOutRGBM(size, size, 4, TypeDesc::UINT8 );
-        specOutRGBM.attribute("oiio:UnassociatedAlpha", 1);
-
-        ImageSpec specOutLUV(size, size, 4, TypeDesc::UINT8 );
-        specOutLUV.attribute("oiio:UnassociatedAlpha", 1);
-
-        ImageBuf dstRGBE(specOutRGBE, _RGBE._image);
-        ImageBuf dstRGBM(specOutRGBM, _RGBM._image);
-        ImageBuf dstLUV(specOutLUV, _LUV._image);
-        ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstRGBE(dstRGBE, 0, size, 0, size);
-        ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstRGBM(dstRGBM, 0, size, 0, size);
-        ImageBuf::Iterator<uint8_t, uint8_t> iteratorDstLUV(dstLUV, 0, size, 0, size);
-
-        float inTmp[3];
-        float* in;
-        for (;iteratorDstRGBE.valid();
-             iteratorSrc++,
-                 iteratorDstRGBE++,
-                 iteratorDstRGBM++,
-                 iteratorDstLUV++ ) {
-
-            iteratorSrc.pos( iteratorDstRGBE.x(), iteratorDstRGBE.y(), iteratorDstRGBE.z());
-
-            float* inRaw = (float*)iteratorSrc.rawptr();
-
-            // we assume to have at least 3 channel in inputs, but it could be greyscale
-            in = inRaw;
-
-            if ( _rgbe ) {
-                uint8_t* outRGBE = (uint8_t*)iteratorDstRGBE.rawptr();
-                encodeRGBE(in, outRGBE );
-            }
-
-            if ( _rgbm ) {
-                uint8_t* outRGBM = (uint8_t*)iteratorDstRGBM.rawptr();
-                encodeRGBM(in, outRGBM );
-            }
-
-            if ( _luv ) {
-                uint8_t* outLUV = (uint8_t*)iteratorDstLUV.rawptr();
-                encodeLUV(in, outLUV );
-            }
-
-#if 0
-            if ( in[0] != 0 && in[1] != 0 && in[2] != 0) {
-                decodeLUV(outLUV, inTmp);
-
-                Vec3f inVec3 = Vec3f(in[0], in[1], in[2]);
-                Vec4f result = LogLuvEncode( inVec3 );
-                Vec3f result2 = LogLuvDecode(result);
-                Vec3f diff = result2 - inVec3;
-                std::cout << diff[0] << " " << diff[1] << " " << diff[2] << std::endl;
-
-                unsigned char test2[4];
-                Vec3f outVec3;
-                encodeLUV( &inVec3[0], test2 );
-                decodeLUV( test2, &outVec3[0] );
-                Vec3f diff2 = outVec3 - inVec3;
-                std::cout << diff2[0] << " " << diff2[1] << " " << diff2[2] << std::endl;
+        // the mipmap image wraps the rgb float buffer, it is encoded in one batch
+        const float* src = (const float*)image->localpixels();
+        size_t count = size_t(size) * size;
 
+        if ( _rgbe )
+            encodeRGBE( src, _RGBE._image, count );
 
-            }
-#endif
+        if ( _rgbm )
+            encodeRGBM( src, _RGBM._image, count );
 
-        }
+        if ( _luv )
+            encodeLUV( src, _LUV._image, count );
 
         if ( _rgbe )
-            _RGBE.pack( _outputDirectory + "_rgbe.bin" );
+            _written = _RGBE.pack( _outputDirectory + "_rgbe.bin" ) && _written;
 
         if ( _luv )
-            _LUV.pack( _outputDirectory + "_luv.bin" );
+            _written = _LUV.pack( _outputDirectory + "_luv.bin" ) && _written;
 
         if ( _rgbm )
-            _RGBM.pack( _outputDirectory + "_rgbm.bin" );
+            _written = _RGBM.pack( _outputDirectory + "_rgbm.bin" ) && _written;
 
     }
 
@@ -290,7 +240,7 @@ public:
 
 static int usage(const std::string& name)
 {
-    std::cerr << "Usage: " << name << " [-e encodingFlags] [-c write by channel] level inputPattern output" << std::endl;
+    std::cerr << "Usage: " << name << " [-e encodingFlags] [-c write by channel] [-z gzip outputs] [-l gzip level] level inputPattern output" << std::endl;
     std::cerr << "eg: " << name << " -e luv:rgbm:rgbe:float 5 input_%d.tif /tmp/test/" << std::endl;
     return 1;
 }
@@ -303,15 +253,21 @@ int main(int argc, char** argv) {
     writeByChannel = false;
     std::string colorencoding = "luv:rgbm:rgbe:float";
 
-    while ((c = getopt(argc, argv, "ce:")) != -1)
+    while ((c = getopt(argc, argv, "czl:e:")) != -1)
         switch (c)
         {
         case 'e': colorencoding = std::string(optarg);     break;
         case 'c': writeByChannel = true;     break;
+        case 'z': compressOutput = true;     break;
+        case 'l': compressionLevel = atoi(optarg);     break;
 
         default: return usage(argv[0]);
         }
 
+    if ( compressionLevel < 0 || compressionLevel > 9 ) {
+        std::cerr << "gzip level should be between 0 and 9" << std::endl;
+        return usage( argv[0] );
+    }
 
     std::string filePattern = argv[1];
     std::string outputDir = argv[3];
@@ -338,4 +294,6 @@ int main(int argc, char** argv) {
 
 
     packer.pack( packer.mipmap() );
+
+    return packer._written ? 0 : 1;
 }
@@ -7,6 +7,7 @@ import math
 import json
 import argparse
 import shutil
+import struct
 
 DEBUG = False
 
@@ -19,6 +20,7 @@ envremap_cmd = "envremap"
 samplesGGX_cmd = "samplesGGX"
 extractLights_cmd = "extractLights"
 envBackground_cmd = "envBackground"
+envProcess_cmd = "envProcess"
 compress_7Zip_cmd = "7z"
 compress_zip_cmd = "zip"
 
@@ -120,6 +122,9 @@ class ProcessEnvironment(object):
 
         self.mipmap_file_base = "mipmap_cubemap"
         self.mipmap_size = 1024
+
+        # face size of the mip level the lights are extracted from
+        self.lights_size = 256
         self.mipmap_filename = None
 
 
@@ -140,6 +145,9 @@ class ProcessEnvironment(object):
         self.main_light = None
         self.lights = None
 
+        # prefix of the outputs of envProcess when it computed the cpu stages
+        self.env_process_prefix = None
+
     def writeConfig(self):
         filename = os.path.join(self.working_directory, "config.json")
         output = open(filename, "w")
@@ -190,6 +198,17 @@ class ProcessEnvironment(object):
                 continue
             for image in texture['images']:
                 f = image["file"]
+                if not os.path.isfile(f) and os.path.isfile(f + '.gz'):
+                    # already compressed by the packers, the gzip trailer ends with the input size
+                    with open(f + '.gz', 'rb') as gz:
+                        gz.seek(-4, os.SEEK_END)
+                        size_before = struct.unpack('<I', gz.read(4))[0]
+                    image["file"] = "{}.gz".format(f)
+                    image["sizeUncompressed"] = size_before
+                    image["sizeCompressed"] = os.path.getsize(f + '.gz')
+                    sys.stdout.write(".")
+                    sys.stdout.flush()
+                    continue
                 size_before = os.path.getsize(f)
                 cmd = "{} a -tgzip -mx={} -mpass=7 {}.gz {}".format(compress_7Zip_cmd, self.compression_level, f, f)
                 execute_command(cmd, verbose=False)
@@ -202,6 +221,9 @@ class ProcessEnvironment(object):
                 os.remove(f)
         print ""
 
+    def packed_file_exists(self, filename):
+        return os.path.exists(filename) or os.path.exists(filename + '.gz')
+
     def zip(self):
         sys.stdout.write("zipping ")
         zip_file= "{}/package.zip".format(self.working_directory)
@@ -224,11 +246,17 @@ class ProcessEnvironment(object):
 
     def compute_irradiance(self):
 
+        # sh_coef is already read from the envProcess log
+        if self.env_process_prefix:
+            return
+
         tmp = "/tmp/irr.tif"
 
         cmd = "{} -n {} {} {}".format(envIrradiance_cmd, self.irradiance_size, self.cubemap_highres, tmp)
         output_log = execute_command(cmd, verbose=False, print_command=True)
+        self.read_sh_coef(output_log)
 
+    def read_sh_coef(self, output_log):
         lines_list = output_log.split("\n")
         for line in lines_list:
             index = line.find("shCoef:")
@@ -241,18 +269,21 @@ class ProcessEnvironment(object):
     def cubemap_packer(self, pattern, max_level, encoding_string, output):
         cmd = ""
         write_by_channel = "-c" if self.write_by_channel else ""
+        # the packers gzip their outputs while writing them, compress() keeps them as is
+        compress = "-z -l {}".format(self.compression_level) if self.can_compress else ""
         encoding = "-e " + encoding_string
         if max_level > 0:
-            cmd = "{} {} {} -p -n {} {} {}".format(cubemap_packer_cmd, encoding,
-                                                   write_by_channel, max_level, pattern, output)
+            cmd = "{} {} {} {} -p -n {} {} {}".format(cubemap_packer_cmd, encoding,
+                                                      write_by_channel, compress, max_level, pattern, output)
         else:
-            cmd = "{} {} {} {} {}".format(cubemap_packer_cmd, encoding, write_by_channel, pattern, output)
+            cmd = "{} {} {} {} {} {}".format(cubemap_packer_cmd, encoding, write_by_channel, compress, pattern, output)
         execute_command(cmd)
 
     def panorama_packer(self, pattern, max_level, output):
         write_by_channel = "-c" if self.write_by_channel else ""
+        compress = "-z -l {}".format(self.compression_level) if self.can_compress else ""
         encoding = "-e " + ":".join(self.encoding_type)
-        cmd = "{} {} {} {} {} {}".format(panorama_packer_cmd, encoding, write_by_channel, pattern, max_level, output)
+        cmd = "{} {} {} {} {} {} {}".format(panorama_packer_cmd, encoding, write_by_channel, compress, pattern, max_level, output)
         execute_command(cmd)
 
     def getMaxLevel(self, value):
@@ -282,7 +313,7 @@ class ProcessEnvironment(object):
     def register_mipmap_cubemap(self):
         encoding = "float"
         file_to_check = "{}_{}.bin".format(self.mipmap_filename, encoding)
-        if os.path.exists(file_to_check) is True:
+        if self.packed_file_exists(file_to_check) is True:
             self.registerImageConfig(encoding, "cubemap", "mipmap", 8, {
                 "width": self.mipmap_size,
                 "height": self.mipmap_size,
@@ -294,8 +325,11 @@ class ProcessEnvironment(object):
         # we dont need to recreate it each time
         outout_filename = os.path.join(self.working_directory, "brdf_ue4.bin")
         size = self.integrate_BRDF_size
-        cmd = "{} -s {} -n {} {}".format(envIntegrateBRDF_cmd, size, self.brdf_nb_samples, outout_filename)
-        execute_command(cmd)
+        if self.env_process_prefix:
+            shutil.move(self.env_process_prefix + "brdf_ue4.bin", outout_filename)
+        else:
+            cmd = "{} -s {} -n {} {}".format(envIntegrateBRDF_cmd, size, self.brdf_nb_samples, outout_filename)
+            execute_command(cmd)
 
         self.registerImageConfig('rg16', 'lut', "brdf_ue4", None, {
             "width": size,
@@ -378,7 +412,7 @@ class ProcessEnvironment(object):
 
         for encoding in self.encoding_type:
             file_to_check = "{}_{}.bin".format(file_basename, encoding)
-            if os.path.exists(file_to_check) is True:
+            if self.packed_file_exists(file_to_check) is True:
                 self.registerImageConfig(encoding, "panorama", "specular_ue4", prefilter_stop_size * 4, {
                     "width": panorama_size,
                     "height": panorama_size,
@@ -389,16 +423,20 @@ class ProcessEnvironment(object):
     def specular_create_prefilter_cubemap(self, specular_size, prefilter_stop_size):
 
         max_level = self.getMaxLevel(specular_size)
-        self.process_cubemap_specular_create_prefilter(
-            specular_size, prefilter_stop_size, True, "/tmp/prefilter_fixup")
+        if self.env_process_prefix:
+            prefilter_pattern = self.env_process_prefix + "prefilter_%d.tif"
+        else:
+            self.process_cubemap_specular_create_prefilter(
+                specular_size, prefilter_stop_size, True, "/tmp/prefilter_fixup")
+            prefilter_pattern = "/tmp/prefilter_fixup_%d.tif"
 
         file_basename = os.path.join(self.working_directory, "specular_cubemap_ue4_{}".format(specular_size))
         self.cubemap_packer(
-            "/tmp/prefilter_fixup_%d.tif", max_level, ":".join(self.encoding_type), file_basename)
+            prefilter_pattern, max_level, ":".join(self.encoding_type), file_basename)
 
         for encoding in self.encoding_type:
             file_to_check = "{}_{}.bin".format(file_basename, encoding)
-            if os.path.exists(file_to_check) is True:
+            if self.packed_file_exists(file_to_check) is True:
                 self.registerImageConfig(encoding, "cubemap", "specular_ue4", prefilter_stop_size, {
                     "width": specular_size,
                     "height": specular_size,
@@ -427,6 +465,8 @@ class ProcessEnvironment(object):
                                                   sample_rotation=self.sample_rotation,
                                                   fix_edge=self.fixedge,
                                                   radius=background_blur)
+        elif self.env_process_prefix:
+            output_filename = self.env_process_prefix + "background.tif"
         else:
             # compute it one time for panorama
             fixedge = "-f" if self.fixedge else ""
@@ -450,7 +490,7 @@ class ProcessEnvironment(object):
 
         for encoding in self.encoding_type:
             file_to_check = "{}_{}.bin".format(file_basename, encoding)
-            if os.path.exists(file_to_check) is True:
+            if self.packed_file_exists(file_to_check) is True:
                 self.registerImageConfig(encoding, "cubemap", "background", None, {
                     "width": background_size,
                     "height": background_size,
@@ -459,6 +499,29 @@ class ProcessEnvironment(object):
                     "samples": samples
                 })
 
+    def process_cpu_stages(self):
+
+        # without gpu the cubemap prefilter, the background, the irradiance
+        # and the brdf lut are computed by one envProcess run sharing the
+        # mip chain, the other methods only pack its outputs
+        if len(self.prefilter_list) != 1 or len(self.background_list) != 1:
+            return
+
+        specular_size = self.prefilter_list[0]
+        background_size, background_blur = self.background_list[0]
+        prefix = "/tmp/env_process_"
+        fixedge = "-x" if self.fixedge else ""
+
+        cmd = "{} -s {} -e {} -n {} -r {} -f -b {} -B {} -N {} -R {} {} -i {} -l {} -S {} {} {}".format(
+            envProcess_cmd, specular_size, self.prefilter_stop_size, self.nb_samples, self.sample_rotation,
+            background_size, background_blur, self.background_samples, self.sample_rotation, fixedge,
+            self.irradiance_size, self.integrate_BRDF_size, self.brdf_nb_samples,
+            self.mipmap_pattern, prefix)
+        output_log = execute_command(cmd, verbose=False, print_command=True)
+        self.read_sh_coef(output_log)
+
+        self.env_process_prefix = prefix
+
     def thumbnail_create(self, thumbnail_size):
 
         # compute it one time for panorama
@@ -490,15 +553,13 @@ class ProcessEnvironment(object):
 
     def extract_lights(self):
 
-        # compute it one time for panorama
-        img_size_x = 1024
-        img_size_y = 512
-        panorama_smaller = os.path.join(self.working_directory, "pano_small_{}.tif".format(img_size_x))
-        cmd = "oiiotool {} --resize {}x{} -o {}".format(
-            self.panorama_highres, img_size_x, img_size_y, panorama_smaller)
-        execute_command(cmd, verbose=False, print_command=True)
-
-        cmd = "{} {}".format(extractLights_cmd, panorama_smaller)
+        # lights are extracted from the faces of the mip level of
+        # lights_size, a small cubemap like the 1024x512 panorama used
+        # before, so no remap is needed
+        levels = [level for level in self.mipmap_files if level["size"] <= self.lights_size]
+        cubemap_lights = levels[0]["filename"] if levels else self.cubemap_highres
+
+        cmd = "{} -c {}".format(extractLights_cmd, cubemap_lights)
         output_log = execute_command(cmd, verbose=False, print_command=True)
         print output_log
         self.lights = output_log
@@ -553,6 +614,12 @@ class ProcessEnvironment(object):
         else:
             print "force computation on cpu"
 
+        if not self.prefilterGPU:
+            start_tick = time.time()
+            self.process_cpu_stages()
+            print "== {} process_cpu_stages ==".format(time.time() - start_tick)
+            print ""
+
         # generate background
         start_tick = time.time()
         for size, blur in self.background_list:
@@ -39,9 +39,9 @@ int main(int argc, char *argv[])
         float r = step * i;
         float roughnessLinear = r*r;
         std::cout << "precompute ggx for roughness " << roughnessLinear << std::endl;
-        precomputedLightInLocalSpace( samples, roughnessLinear, mip0Size );
+        GGXSampleSet sampleSet( samples, roughnessLinear, mip0Size );
 
-        ubyte* buffer = (ubyte*)getPrecomputedLightCache();
+        ubyte* buffer = (ubyte*)sampleSet.getSamples();
         fwrite(buffer, samples*4*4, 1 , file );
 
     }